@@ -1,694 +1,5993 @@
-/*
-===============================================================
-                  MULTI-THREADED DOWNLOADER
-                                      - Huy Ngo
-===============================================================
-
-*/
-
-/* ===============================================================
-                            INCLUDES
-=============================================================== */
-#include <curl/curl.h>
-#include <err.h>
-#include <fcntl.h>
-#include <getopt.h>
-#include <ncurses.h>
-#include <pthread.h>
-#include <signal.h>
-#include <stdbool.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/ioctl.h>
-#include <unistd.h>
-
-/* ===============================================================
-                              STRUCTS
-=============================================================== */
-typedef struct {
-  char *url;        // URL to download from
-  char *filename;   // filename to save to
-  int max_threads;  // maximum number of threads
-} DLSettings;       // settings for downloader
-
-typedef struct {
-  int index;                 // thread index
-  char *url;                 // URL to download from
-  unsigned long long start;  // start byte
-  unsigned long long end;    // end byte
-} DLThreadArgs;              // arguments for each thread
-
-typedef struct {
-  pthread_t thread;    // thread handle
-  DLThreadArgs *args;  // thread arguments
-  CURL *curl;          // curl handle
-  FILE *buffer;        // file handle
-} DLThreadInfo;        // information about each thread
-
-typedef struct {
-  curl_off_t *total_bytes;       // total bytes to download
-  curl_off_t *downloaded_bytes;  // downloaded bytes so far
-} DLProgress;                    // progress information
-
-/* ===============================================================
-                          DEFS and GLOBALS
-=============================================================== */
-#define DEFAULT_MAX_THREADS 4
-#define CLEAR_SCREEN "\033[2J\033[1;1H"
-#define CHECKMARK "\u2713"
-#define CROSSMARK "\u2717"
-#define BOLD "\033[1m"
-#define RESET "\033[0m"
-#define RED "\033[31m"
-#define GREEN "\033[32m"
-#define YELLOW "\033[33m"
-#define CYAN "\033[36m"
-#define WHITE "\033[37m"
-#define GREY "\033[90m"
-
-DLThreadInfo **thread_infos;      // global array of thread_infos
-DLProgress progress;              // global progress
-DLSettings settings;              // global settings
-int window_width;                 // terminal width
-int window_height;                // terminal height
-char log_buffer[2048];            // buffer to store logs from threads
-pthread_mutex_t completed_mutex;  // mutex for completed_counter
-int completed_counter = 0;        // counter for completed threads
-time_t start_time;                // start time of download
-bool paused;                      // whether download is paused
-
-/* ===============================================================
-                      RENDERING and INTERFACE
-=============================================================== */
-// Calculate width and print at center
-void print_center(char *str) {
-  int padding = (window_width - strlen(str)) / 2;
-  printf("%*s", padding, "");
-  printf("%s", str);
-}
-
-// Print header based on screen size
-void print_header() {
-  for (int i = 0; i < window_width; i++) {
-    printf("=");
-  }
-  printf(RESET "\n\n" BOLD RED);
-  print_center("MULTI-THREADED DOWNLOADER");
-  printf("\n" RESET CYAN);
-  print_center("by Huy Ngo");
-  printf("\n\n" RESET);
-  for (int i = 0; i < window_width; i++) {
-    printf("=");
-  }
-  printf("\n\n" RESET);
-}
-
-// Print download info
-void print_download_info() {
-  printf(BOLD);
-  print_center("[ Download Info ]");
-  printf("\n\n" RESET CYAN BOLD);
-  print_center(settings.url);
-  printf("\n" GREEN);
-  print_center(settings.filename);
-  printf("\n\n" RESET);
-}
-
-// Clear screen
-void clear_screen() { system("clear"); }
-
-/* ===============================================================
-                          DOWNLOAD SETUP
-=============================================================== */
-// Use getopts to parse command line arguments
-void parse_args(int argc, char *argv[]) {
-  // ./mtdown -u <url> -o <filename> -n <max_threads>
-  int opt;
-  while ((opt = getopt(argc, argv, "u:o:n:")) != -1) {
-    switch (opt) {
-      case 'u':
-        settings.url = optarg;
-        break;
-      case 'o':
-        settings.filename = optarg;
-        break;
-      case 'n':
-        // Check if optarg is a number using atoi
-        if (atoi(optarg) == 0) {
-          fprintf(stderr, "Error: max_threads must be a number\n");
-          exit(EXIT_FAILURE);
-        }
-        // Check if optarg is valid (1 - 32)
-        if (atoi(optarg) < 1 || atoi(optarg) > 32) {
-          fprintf(stderr, "Error: max_threads must be between 1 and 32\n");
-          exit(EXIT_FAILURE);
-        }
-        settings.max_threads = atoi(optarg);
-        break;
-      default:
-        fprintf(stderr, "Usage: %s -u <url> -o <filename> -n <max_threads>\n",
-                argv[0]);
-        exit(EXIT_FAILURE);
-    }
-  }
-
-  // Check if url is provided
-  if (settings.url == NULL) {
-    fprintf(stderr, "Usage: %s -u <url> -o <filename> -n <max_threads>\n",
-            argv[0]);
-    exit(EXIT_FAILURE);
-  }
-
-  // Check if filename is provided
-  if (settings.filename == NULL) {
-    fprintf(stderr, "Usage: %s -u <url> -o <filename> -n <max_threads>\n",
-            argv[0]);
-    exit(EXIT_FAILURE);
-  }
-
-  // Check if max_threads is provided
-  if (settings.max_threads == 0) {
-    settings.max_threads = DEFAULT_MAX_THREADS;
-  }
-}
-
-// Callback function to disable writing from curl, this is to gather data about
-// the server before actually downloading
-size_t no_write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-  return size * nmemb;
-}
-
-// Find max concurrent connection the server allows by sending a series of
-// concurrent requests and then record when a thread fails to receive data
-void *find_max_thread_worker() {
-  // Setup curl
-  CURL *curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, settings.url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, no_write_callback);
-  curl_easy_setopt(curl, CURLOPT_MAX_RECV_SPEED_LARGE, (curl_off_t)1);
-  curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, 1000);
-  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1);
-  curl_easy_perform(curl);
-  int res = 0;
-  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &res);
-  curl_easy_cleanup(curl);
-  // Return res as void pointer for later conversion
-  return (void *)res;
-}
-int find_max_threads() {
-  clear_screen();
-  print_header();
-
-  int max_threads = 1;
-
-  printf("Finding maximum concurrent connections supported by server...\n");
-
-  // Find max concurrent connections by testing the maximum number of concurrent
-  // connections the server allows before returning an error response.
-  for (int i = 1; i <= settings.max_threads; i++) {
-    printf("Trying %d threads... ", i);
-    fflush(stdout);
-
-    pthread_t threads[i];
-
-    for (int j = 0; j < i; j++)
-      pthread_create(&threads[j], NULL, find_max_thread_worker, NULL);
-
-    for (int j = 0; j < i; j++) {
-      void *res;
-      pthread_join(threads[j], &res);
-      if ((int)res != 200) {
-        printf(RED "%s\n" RESET, CROSSMARK);
-        return i - 1;
-      }
-    }
-    printf(GREEN "%s\n" RESET, CHECKMARK);
-    max_threads = i;
-
-    // Sleep to give the server time to recover
-    sleep(1);
-  }
-
-  return max_threads;
-}
-
-// Callback function for writing to buffer
-size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
-  // Get buffer
-  FILE *buffer = (FILE *)userdata;
-  size_t realsize = size * nmemb;
-
-  // Write to buffer (the buffer is the file descriptor each thread is writing
-  // to)
-  fwrite(ptr, size, nmemb, buffer);
-
-  return realsize;
-}
-
-// Progress callback for updating global progress
-size_t progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
-                         curl_off_t ultotal, curl_off_t ulnow) {
-  // Get args from clientp
-  DLThreadArgs *args = (DLThreadArgs *)clientp;
-
-  // Update progress total bytes at index
-  progress.total_bytes[args->index] = dltotal;
-  progress.downloaded_bytes[args->index] = dlnow;
-
-  return 0;
-}
-
-// Fetch content length, calculate chunk size, and setup worker threads to
-// download to each part of the buffer
-void *download_worker(void *info) {
-  // Get thread info and args
-  DLThreadInfo *thread_info = (DLThreadInfo *)info;
-  DLThreadArgs *thread_args = thread_info->args;
-
-  // Get curl
-  CURL *curl = thread_info->curl;
-
-  // Error string
-  char errbuf[CURL_ERROR_SIZE];
-
-  // Get download range
-  char range[128];
-  snprintf(range, sizeof(range), "%llu-%llu", thread_args->start,
-           thread_args->end);
-
-  // Set curl options
-  curl_easy_setopt(curl, CURLOPT_URL, settings.url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, thread_info->buffer);
-  curl_easy_setopt(curl, CURLOPT_USERAGENT, "mtdown/1.0");
-  curl_easy_setopt(curl, CURLOPT_RANGE, range);
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
-  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
-  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, thread_args);
-  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-
-  CURLcode res;
-
-  // Download file, if error try for another 4 times, then exit if still broken
-  for (int i = 0; i < 5; i++) {
-    res = curl_easy_perform(curl);
-
-    if (res == CURLE_OK) break;
-
-    // Add thread id and error to thread_info->logs with strcat
-    char log[310];
-    if (i == 4)
-      snprintf(log, sizeof(log),
-               RED "ERROR | Thread %d: %s, exiting...\n" RESET,
-               thread_args->index, errbuf);
-    else
-      snprintf(log, sizeof(log),
-               RED "ERROR | Thread %d: %s, retrying...\n" RESET,
-               thread_args->index, errbuf);
-    strcat(log_buffer, log);
-
-    // Reset file pointer to thread_args start
-    fseek(thread_info->buffer, thread_args->start, SEEK_SET);
-
-    sleep(1);
-  }
-
-  // Cleanup curl
-  curl_easy_cleanup(curl);
-
-  // Close buffer
-  fclose(thread_info->buffer);
-
-  // Increase completed counter
-  pthread_mutex_lock(&completed_mutex);
-  completed_counter++;
-  pthread_mutex_unlock(&completed_mutex);
-
-  return NULL;
-}
-void setup_download() {
-  // Fetch content length
-  CURL *curl = curl_easy_init();
-  curl_easy_setopt(curl, CURLOPT_URL, settings.url);
-  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
-  curl_easy_perform(curl);
-  curl_off_t res = 0;
-  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &res);
-  curl_easy_cleanup(curl);
-
-  // Check if content length is valid
-  if (res <= 0) {
-    printf("ERROR | Could not fetch content length\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Calculate chunk size
-  curl_off_t chunk_size = res / settings.max_threads;
-
-  // Setup global thread_info array
-  thread_infos = malloc(sizeof(DLThreadInfo *) * settings.max_threads);
-
-  // Check error
-  if (thread_infos == NULL) {
-    printf("ERROR | Could not allocate thread_infos\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Malloc total bytes in progress
-  progress.downloaded_bytes = malloc(sizeof(curl_off_t) * settings.max_threads);
-  progress.total_bytes = malloc(sizeof(curl_off_t) * settings.max_threads);
-
-  // Check error
-  if (progress.downloaded_bytes == NULL || progress.total_bytes == NULL) {
-    printf("ERROR | Could not allocate progress\n");
-    exit(EXIT_FAILURE);
-  }
-
-  // Set paused to false
-  paused = false;
-
-  // Check if file exists, asks user if they want to overwrite
-  FILE *file = fopen(settings.filename, "r");
-  if (file != NULL) {
-    fclose(file);
-    printf(RED BOLD "\nFile %s already exists, overwrite? (y/n) " RESET,
-           settings.filename);
-    char c;
-    scanf("%c", &c);
-    if (c == 'n') exit(EXIT_SUCCESS);
-  }
-
-  // Create file of size res for all threads to write into
-  file = fopen(settings.filename, "wb");
-
-  // Check error
-  if (file == NULL) {
-    printf("ERROR | Could not create file %s\n", settings.filename);
-    exit(EXIT_FAILURE);
-  }
-
-  // Allocate size of res
-  fallocate(fileno(file), 0, 0, res);
-  if (ferror(file)) {
-    printf("ERROR | Could not allocate file %s\n", settings.filename);
-    exit(EXIT_FAILURE);
-  }
-
-  fclose(file);
-
-  // Setup worker threads using global threads array, each buffer is
-  // thread-specific
-  for (int i = 0; i < settings.max_threads; i++) {
-    // Allocate spot in thread_info array
-    thread_infos[i] = malloc(sizeof(DLThreadInfo));
-
-    // Check error
-    if (thread_infos[i] == NULL) {
-      printf("ERROR | Could not allocate thread_info for thread %d\n", i);
-      exit(EXIT_FAILURE);
-    }
-
-    // Allocate a file buffer for each thread
-    // Seek accordingly
-    thread_infos[i]->buffer = fopen(settings.filename, "wb");
-
-    // Check error
-    if (thread_infos[i]->buffer == NULL) {
-      printf("ERROR | Could not open file %s for thread %d\n",
-             settings.filename, i);
-      exit(EXIT_FAILURE);
-    }
-
-    fseek(thread_infos[i]->buffer, i * chunk_size, SEEK_SET);
-
-    // Allocate args
-    thread_infos[i]->args = malloc(sizeof(DLThreadArgs));
-
-    // Check error
-    if (thread_infos[i]->args == NULL) {
-      printf("ERROR | Could not allocate thread_args for thread %d\n", i);
-      exit(EXIT_FAILURE);
-    }
-
-    thread_infos[i]->args->index = i;
-    thread_infos[i]->args->start = i * chunk_size;
-    thread_infos[i]->args->end = (i + 1) * chunk_size - 1;
-
-    // Set end of last thread to content length
-    if (i == settings.max_threads - 1) thread_infos[i]->args->end = res;
-
-    // Assign the rest of the thread info
-    thread_infos[i]->curl = curl_easy_init();
-
-    // Add download started to log
-    char log[256];
-    snprintf(log, sizeof(log),
-             GREY " INFO | Thread %d started downloading.\n" RESET, i);
-    strcat(log_buffer, log);
-
-    // Create thread
-    pthread_create(&thread_infos[i]->thread, NULL, download_worker,
-                   thread_infos[i]);
-  }
-}
-
-/* ===============================================================
-                      PROGRESS and POST-DOWNLOAD
-=============================================================== */
-// Print bytes downloaded/total bytes and progress
-void printProgress(curl_off_t downloaded, curl_off_t total) {
-  // Find suitable unit for downloaded and total
-  if (total > 1000000000)
-    printf("%.2f / %.2f GB (%.2f%%)\n", (double)downloaded / 1000000000,
-           (double)total / 1000000000, (double)downloaded / total * 100);
-  else if (total > 1000000)
-    printf("%.2f / %.2f MB (%.2f%%)\n", (double)downloaded / 1000000,
-           (double)total / 1000000, (double)downloaded / total * 100);
-  else if (total > 1000)
-    printf("%.2f / %.2f KB (%.2f%%)\n", (double)downloaded / 1000,
-           (double)total / 1000, (double)downloaded / total * 100);
-  else
-    printf("%ld / %ld B (%.2f%%)\n", downloaded, total,
-           (double)downloaded / total * 100);
-}
-
-// Print speed and ETA
-void printSpeed(curl_off_t downloaded, curl_off_t total, time_t start_time,
-                time_t elapsed_time) {
-  // Calculate speed and eta
-  double speed = (double)downloaded / (time(NULL) - start_time);
-  double eta = (double)(total - downloaded) / speed;
-
-  // Find suitable unit for speed
-  if (speed > 1000000000)
-    printf("%.2f GB/s", speed / 1000000000);
-  else if (speed > 1000000)
-    printf("%.2f MB/s", speed / 1000000);
-  else if (speed > 1000)
-    printf("%.2f KB/s", speed / 1000);
-  else
-    printf("%.2f B/s", speed);
-
-  // Find suitable unit for ETA
-  if (eta > 3600)
-    printf(" (%.2f hours remaining)\n", eta / 3600);
-  else if (eta > 60)
-    printf(" (%.2f minutes remaining)\n", eta / 60);
-  else
-    printf(" (%.2f seconds remaining)\n", eta);
-}
-
-// Pause handler
-void pause_handler() {
-  if (paused) {
-    // Resume all threads
-    for (int i = 0; i < settings.max_threads; i++)
-      curl_easy_pause(thread_infos[i]->curl, CURLPAUSE_CONT);
-    paused = false;
-
-    // Print to log
-    char log[256];
-    snprintf(log, sizeof(log), GREEN " INFO | Download resumed.\n" RESET);
-    strcat(log_buffer, log);
-  } else {
-    // Pause all threads
-    for (int i = 0; i < settings.max_threads; i++)
-      curl_easy_pause(thread_infos[i]->curl, CURLPAUSE_RECV);
-    paused = true;
-    // Print to log
-    char log[256];
-    snprintf(log, sizeof(log), YELLOW " INFO | Download paused.\n" RESET);
-    strcat(log_buffer, log);
-  }
-}
-
-// Quit handler
-void quit_handler() {
-  // Print to log
-  char log[256];
-  snprintf(log, sizeof(log),
-           RED "ERROR | Download cancelled by user, exiting...\n" RESET);
-  strcat(log_buffer, log);
-}
-
-// Wait for all threads to complete, print status and progress bar
-void wait_for_threads() {
-  while (completed_counter < settings.max_threads) {
-    // ncurses used here for non blocking read, allowing pause and quit at
-    // anytime
-    initscr();
-    // Get new window size in case of resize
-    getmaxyx(stdscr, window_height, window_width);
-    timeout(500);
-    noecho();
-    cbreak();
-    char c = getch();
-    if (c == 'p' || c == 'P') {
-      pause_handler();
-    }
-    if (c == 'q' || c == 'Q') {
-      quit_handler();
-    }
-    endwin();
-
-    // Start printing progress
-    clear_screen();
-    print_header();
-    print_download_info();
-
-    // Progress Bar and Status
-    double thread_bar_length = window_width - 45;
-    curl_off_t total_downloaded = 0;
-    curl_off_t total_bytes = 0;
-
-    printf(BOLD);
-    print_center("[ Progress | Press P to pause, Q to quit ]");
-    printf("\n\n" RESET);
-
-    for (int i = 0; i < settings.max_threads; i++) {
-      total_downloaded += progress.downloaded_bytes[i];
-      total_bytes += progress.total_bytes[i];
-
-      printf(" Thread %d: " WHITE, i);
-
-      for (double j = 0; j < (double)progress.downloaded_bytes[i] /
-                                 progress.total_bytes[i] * thread_bar_length + 1.0;
-           j++) {
-        printf("█");
-      }
-
-      printf(GREY);
-
-      for (double j = (double)progress.downloaded_bytes[i] /
-                      progress.total_bytes[i] * thread_bar_length;
-           j < thread_bar_length; j++) {
-        printf("█");
-      }
-
-      printf(" " RESET);
-      printProgress(progress.downloaded_bytes[i], progress.total_bytes[i]);
-    }
-
-    // Update speed and progress
-    time_t current_time = time(NULL);
-    double elapsed_time = difftime(current_time, start_time);
-    double speed = total_downloaded / elapsed_time;
-
-    // Print progress
-    printf("\n");
-    for (int i = 0; i < (window_width - 24) / 2; i++) printf(" ");
-    printProgress(total_downloaded, total_bytes);
-
-    // Print speed and ETA
-    for (int i = 0; i < (window_width - 37) / 2; i++) printf(" ");
-    printSpeed(total_downloaded, total_bytes, start_time, elapsed_time);
-
-    // Check for logs
-    printf("\n" BOLD);
-    print_center("[ Logs ]");
-    printf("\n" RESET);
-    printf("%s", log_buffer);
-
-    // Exit if "exiting..." is found in logs
-    if (strstr(log_buffer, "exiting...") != NULL) {
-      for (int i = 0; i < settings.max_threads; i++) {
-        curl_easy_setopt(thread_infos[i]->curl, CURLOPT_TIMEOUT_MS, 1);
-        pthread_cancel(thread_infos[i]->thread);
-      }
-      return;
-    }
-  }
-
-  // Join all threads after download is complete
-  for (int i = 0; i < settings.max_threads; i++) {
-    pthread_join(thread_infos[i]->thread, NULL);
-  }
-}
-
-// Free everything if exist
-void free_all() {
-  // Free thread info
-  for (int i = 0; i < settings.max_threads; i++) {
-    if (thread_infos[i] && thread_infos[i]->args) free(thread_infos[i]->args);
-    if (thread_infos[i]) free(thread_infos[i]);
-  }
-  if (thread_infos) free(thread_infos);
-
-  // Free progress
-  if (progress.downloaded_bytes) free(progress.downloaded_bytes);
-  if (progress.total_bytes) free(progress.total_bytes);
-}
-
-/* ===============================================================
-                              MAIN
-=============================================================== */
-int main(int argc, char *argv[]) {
-  // Get window width and height
-  struct winsize w;
-  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
-  window_width = w.ws_col;
-  window_height = w.ws_row;
-
-  // Parse command line arguments
-  parse_args(argc, argv);
-
-  // Initialize curl
-  curl_global_init(CURL_GLOBAL_ALL);
-
-  // Find max concurrent connection the server allows
-  settings.max_threads = find_max_threads();
-  printf(BOLD "\nMax threads updated: %d\n" RESET
-              "Starting download in 2 seconds...\n",
-         settings.max_threads);
-  sleep(1);
-
-  // Init global mutex
-  pthread_mutex_init(&completed_mutex, NULL);
-
-  // Setup download
-  setup_download();
-
-  // Start timer
-  start_time = time(NULL);
-
-  // Wait for all threads to complete
-  wait_for_threads();
-
-  // Print finish
-  printf("\n\n" GREEN BOLD);
-  print_center("Download Complete ");
-  printf(CHECKMARK "\n" RESET);
-
-  // Destroy mutex
-  pthread_mutex_destroy(&completed_mutex);
-
-  // Free everything
-  free_all();
-
-  // Cleanup curl
-  curl_global_cleanup();
-
-  return 0;
-}
+/*
+===============================================================
+                  MULTI-THREADED DOWNLOADER
+                                      - Huy Ngo
+===============================================================
+
+*/
+
+/* ===============================================================
+                            INCLUDES
+=============================================================== */
+#define _GNU_SOURCE  // for fallocate
+#include <curl/curl.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <linux/io_uring.h>
+#include <ncurses.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+/* ===============================================================
+                              STRUCTS
+=============================================================== */
+#define MAX_MIRRORS 8  // upper bound for URLs of one file
+#define CACHE_LINE 64  // bytes per CPU cache line
+
+typedef enum {
+  IO_SYNC,   // pwrite from the network thread
+  IO_URING,  // hand buffers to a per-thread io_uring
+  IO_THREAD,  // queue buffers to dedicated writer threads
+  IO_MMAP,    // copy straight into a shared mapping of the file
+  IO_DIRECT,  // write whole blocks with O_DIRECT, bypassing the page cache
+  IO_STREAM,  // reorder in memory and write to stdout in order
+} DLIOMode;  // how received data is written to disk
+
+typedef struct {
+  char *url;        // URL to download from, the first of urls
+  char *filename;   // filename to save to
+  int max_threads;  // maximum number of threads
+  int hedge_conns;  // maximum number of hedges running at once
+  unsigned long long hedge_bytes;  // maximum bytes downloaded twice by hedges
+  DLIOMode io_mode;                // disk writer backend
+  int writers;                     // number of writer threads for IO_THREAD
+  unsigned long long direct_pool;  // bytes of aligned buffers for IO_DIRECT
+  int loops;  // event loop threads driving all transfers, 0 for one thread
+              // per connection
+  int http2;  // multiplexed HTTP/2 connections, one per loop, 0 for HTTP/1.1
+  unsigned long long rate_limit;  // bytes per second of the whole download,
+                                  // 0 for no limit
+  unsigned long long conn_rate;   // bytes per second of each connection, 0 for
+                                  // no limit
+  char *input;     // list of URLs for batch mode, "-" for stdin
+  int host_conns;  // connections per host in batch mode, 0 for max_threads
+  unsigned long long small_size;  // files up to this size skip splitting
+  char *urls[MAX_MIRRORS];  // every URL given for the file, mirrors of it
+  int url_count;            // number of URLs given
+  unsigned long long reorder_buffer;  // memory holding out of order data
+                                      // when streaming to stdout
+  const EVP_MD *checksum_md;  // hash function of the checksum, NULL for none
+  char *checksum;             // hex digest the file must have
+  char *manifest;             // piece hashes the file is checked against
+  char *manifest_out;         // where to save the piece hashes of the file
+  unsigned long long piece_size;  // bytes per piece of a saved manifest
+  bool verify;  // take an existing file as downloaded as far as its pieces
+                // match the manifest
+  char *metalink;  // Metalink the URLs, length and hashes are read from
+} DLSettings;  // settings for downloader
+
+typedef struct {
+  unsigned long long start;  // start byte
+  unsigned long long end;    // end byte
+} DLRange;                   // a unit of work, inclusive on both ends
+
+typedef struct {
+  unsigned long long rate;  // bytes per second, 0 for no limit, atomic
+  unsigned long long due;   // time in ns by which everything taken so far is
+                            // paid for, atomic
+} DLBucket;  // token bucket kept as a virtual clock, so taking from it is a
+             // single compare and swap
+
+typedef struct DLThreadArgs DLThreadArgs;
+struct DLThreadArgs {
+  int index;                 // thread index
+  char *url;                 // URL to download from
+  unsigned long long start;  // start byte of current range
+  unsigned long long end;    // end byte of current range, shrinks when stolen
+  unsigned long long pos;    // next byte to be written in current range
+  unsigned long long durable;  // bytes of the range before this are in the file
+  double started;            // time the current range was handed out
+  bool abandoned;            // range was finished by the other side of a hedge
+  DLThreadArgs *partner;     // thread downloading the same range as a hedge
+  unsigned long long hedge_from;  // first byte downloaded by both partners
+  pthread_mutex_t lock;      // mutex for end, pos and abandoned
+};                           // arguments for each thread
+
+typedef struct {
+  unsigned long long offset;  // file offset the buffer is written to
+  size_t len;                 // bytes in the buffer
+  size_t done;                // bytes already written
+} DLRingBuffer;               // a registered buffer owned by a ring
+
+typedef struct {
+  int fd;                      // ring descriptor
+  void *sq_ring;               // mapped submission ring
+  void *cq_ring;               // mapped completion ring
+  size_t sq_ring_size;         // size of the submission ring mapping
+  size_t cq_ring_size;         // size of the completion ring mapping
+  unsigned *sq_tail;           // submission ring tail, written by us
+  unsigned *sq_mask;           // submission ring index mask
+  unsigned *sq_array;          // submission ring index array
+  unsigned *cq_head;           // completion ring head, written by us
+  unsigned *cq_tail;           // completion ring tail, written by the kernel
+  unsigned *cq_mask;           // completion ring index mask
+  struct io_uring_sqe *sqes;   // submission queue entries
+  struct io_uring_cqe *cqes;   // completion queue entries
+  char *memory;                // backing memory of all registered buffers
+  DLRingBuffer *buffers;       // registered buffers
+  int *free;                   // stack of buffers ready to be filled
+  int free_count;              // number of free buffers
+  int fill;                    // buffer being filled, -1 if none
+  unsigned queued;             // entries written but not yet submitted
+  int inflight;                // buffers submitted but not completed
+  int error;                   // first write error seen, 0 if none
+} DLRing;                      // per-thread io_uring disk writer
+
+typedef struct DLThreadInfo DLThreadInfo;
+
+typedef enum {
+  TAKE_NONE,   // no work left for this thread
+  TAKE_FOUND,  // a range was assigned
+  TAKE_WAIT,   // nothing now, but a range in flight may need a hedge later
+} DLTake;      // result of asking the scheduler for a range
+
+typedef enum {
+  ATTEMPT_DONE,    // the range is in the file
+  ATTEMPT_RETRY,   // the transfer failed, try again after a backoff
+  ATTEMPT_FAILED,  // too many tries without progress, give up
+} DLAttempt;       // outcome of one transfer of a range
+
+typedef enum {
+  CONN_ACTIVE,   // transfer is in the loop's multi handle
+  CONN_BACKOFF,  // waiting to retry the range
+  CONN_POLL,     // waiting to ask the scheduler for work again
+  CONN_DONE,     // no work left
+} DLConnState;   // what a connection driven by an event loop is doing
+
+typedef struct {
+  pthread_t thread;  // loop thread handle
+  int index;         // loop index, it drives every connection i % loops
+  CURLM *multi;      // multi handle holding the loop's transfers
+  int epoll_fd;      // sockets curl asked the loop to watch
+  double timer_at;   // when curl wants its timeout handled, -1 if never
+} DLLoop;            // event loop driving a share of the connections
+
+typedef struct {
+  unsigned long seq;          // sequence number, tells whose turn the slot is
+  DLThreadInfo *owner;        // thread that queued the data
+  unsigned long long offset;  // file offset the data is written to
+  size_t len;                 // bytes of data
+  char *data;                 // preallocated copy of the received data
+} DLWriteSlot;                // one entry of a writer queue
+
+typedef struct {
+  pthread_t thread;            // writer thread handle
+  DLWriteSlot *slots;          // bounded queue shared by network threads
+  char *memory;                // backing memory of all slot data
+  unsigned long enqueue_pos;   // next slot to claim, shared by producers
+  unsigned long dequeue_pos;   // next slot to write, owned by the writer
+  int sleeping;                // writer is waiting for data
+  bool stop;                   // writer should exit once the queue is empty
+  pthread_mutex_t mutex;       // mutex for cond
+  pthread_cond_t cond;         // wakes a sleeping writer
+} DLWriter;                    // writer thread fed by a lock-free MPSC queue
+
+struct DLThreadInfo {
+  pthread_t thread;    // thread handle
+  DLThreadArgs *args;  // thread arguments
+  CURL *curl;          // curl handle
+  DLRing *ring;        // io_uring writer, NULL for synchronous writes
+  DLWriter *writer;    // writer thread the data is queued to for IO_THREAD
+  DLWriteSlot *slot;   // slot reserved for the data being received
+  unsigned long queued;   // slots handed to the writer
+  unsigned long written;  // slots the writer has finished, atomic
+  int write_error;        // first error the writer hit, atomic
+  bool write_paused;      // transfer paused because the writer queue is full
+  char *direct_buffer;    // pool buffer being filled for IO_DIRECT
+  unsigned long long direct_offset;  // block aligned file offset of the buffer
+  size_t direct_len;                 // bytes in the buffer
+  char errbuf[CURL_ERROR_SIZE];      // error message of the last transfer
+  unsigned long long requested;      // first byte asked for by the transfer
+  int failures;        // tries in a row that made no progress
+  unsigned int seed;   // random state for backoff jitter
+  bool user_paused;    // transfer paused because the user paused
+  bool rate_paused;    // transfer paused because it is over a speed limit
+  double throttled_until;  // when the speed limits allow more data
+  DLBucket bucket;     // speed limit of the connection alone
+  int mirror;          // mirror of the current transfer, -1 between transfers
+  curl_off_t content_from;   // first byte of the response's Content-Range,
+                             // -1 without one
+  curl_off_t content_total;  // file length from the Content-Range, 0 when
+                             // the server sends * instead
+  unsigned long long skip;   // bytes of a whole-file response to drop before
+                             // the requested offset
+  DLLoop *loop;        // event loop driving the connection, NULL if threaded
+  DLConnState state;   // what the connection is doing when loop driven
+  double wake_at;      // when a waiting loop connection acts again
+};                     // information about each thread
+
+typedef struct {
+  unsigned int seq;              // odd while the thread changes the counters,
+                                 // atomic
+  curl_off_t total_bytes;        // total bytes to download, atomic
+  curl_off_t downloaded_bytes;   // downloaded bytes so far, atomic
+  curl_off_t retries;            // failed tries that were tried again, atomic
+  double rate;                   // bytes per second over the last control
+                                 // interval, main thread only
+  curl_off_t measured;           // downloaded_bytes when rate was measured,
+                                 // main thread only
+} __attribute__((aligned(CACHE_LINE))) DLStats;  // progress of one thread, a
+                                                 // cache line of its own so
+                                                 // threads never share one
+
+typedef struct {
+  DLStats *threads;              // progress of every thread
+} DLProgress;                    // progress information
+
+typedef enum {
+  SIZE_PENDING,  // the first ranged GET is waiting for its response headers
+  SIZE_KNOWN,    // its Content-Range gave the length, setup can go ahead
+  SIZE_FAILED,   // no usable Content-Range, setup falls back to HEAD
+  SIZE_READY,    // the file is set up, threads may take ranges and write
+} DLSizing;      // how far setup has come in learning the file's length
+
+typedef struct {
+  DLRange *units;         // work units the file is cut into, in file order
+  int unit_count;         // number of work units
+  int next_unit;          // index of the next unit to hand out
+  double started;         // time the queue was set up
+  int hedges_active;      // number of ranges being downloaded twice
+  unsigned long long hedge_bytes;  // bytes handed out to hedges so far
+  DLRange *returned;      // ranges given back by threads over the limit
+  int returned_count;     // number of returned ranges
+  int conn_limit;         // threads below this index may take work
+  int throttled;          // server push backs since the controller last
+                          // looked, atomic
+  DLSizing sizing;        // whether the file is set up yet
+  DLThreadArgs *first;    // thread that sent the first ranged GET
+  bool single;            // Range is ignored, one connection streams the rest
+  bool stopping;          // the download is stopped, threads give up their
+                          // ranges and exit, atomic
+  curl_off_t first_length;  // length from the first GET's Content-Range
+  pthread_mutex_t mutex;  // mutex for the queue, stealing and hedging
+  pthread_cond_t cond;    // wakes threads waiting for work or for setup
+} DLScheduler;            // shared queue of work units
+
+typedef struct {
+  char *path;                 // sidecar file next to the output
+  char *validator;            // ETag or Last-Modified of the remote file
+  unsigned long long blocks;  // number of blocks in the file
+  unsigned char *bitmap;      // one bit per block that is in the file
+  DLRange *done;              // merged byte ranges known to be in the file
+  int done_count;             // number of merged ranges
+  int done_capacity;          // allocated size of done
+  curl_off_t resumed_bytes;   // bytes already in the file when resuming,
+                              // atomic once the hasher runs
+  double saved;               // time the journal was last saved
+  pthread_mutex_t mutex;      // mutex for bitmap and done
+} DLJournal;                  // resume journal of completed blocks
+
+typedef struct {
+  int fd;                      // the original stdout, the file goes there
+  char *buffer;                // reorder buffer, offset o is at o % size
+  unsigned long long size;     // size of buffer, whole blocks
+  unsigned long long flushed;  // bytes written out so far, in order
+  unsigned char *spilled;      // one bit per block kept in the spill file
+  char *scratch;               // one block read back from the spill file
+  bool failed;                 // writing to stdout failed
+  pthread_t thread;            // flusher thread
+  pthread_mutex_t mutex;       // mutex for flushed, spilled and buffer
+} DLStream;                    // in order output of a download to stdout
+
+typedef struct {
+  EVP_MD_CTX *ctx;             // hash of the bytes so far
+  unsigned long long hashed;   // bytes hashed so far, in file order
+  char *buffer;                // chunk read back from the file
+  bool failed;                 // reading the file back failed
+  bool running;                // a hasher thread is reading the file
+  bool mismatch;               // the file does not have the checksum given
+  bool stop;                   // the download stopped, the hasher exits
+  unsigned long long wakeups;  // times more of the file became durable
+  pthread_t thread;            // hasher thread
+  pthread_mutex_t mutex;       // mutex for stop and wakeups
+  pthread_cond_t cond;         // wakes the hasher when there is more to hash
+} DLDigest;                    // checksum computed while downloading
+
+typedef struct {
+  const EVP_MD *md;            // hash function of the pieces, NULL for none
+  unsigned long long size;     // bytes per piece, the last may be shorter
+  unsigned long long count;    // number of pieces
+  unsigned char *expected;     // hash every piece must have, NULL when the
+                               // hashes are only saved
+  unsigned char *hashes;       // hash of every piece as downloaded
+  unsigned char *good;         // 1 for every piece hashed and found good
+  unsigned char *tries;        // times each piece did not match
+  unsigned long long checked;  // pieces found good, atomic
+  int redone;                  // pieces downloaded again
+  bool failed;                 // a piece kept failing, the download stops
+  EVP_MD_CTX *ctx;             // hash of the piece being read
+  EVP_MD_CTX *saved;           // file checksum as of the piece's start
+  unsigned char *sources;      // bit of every mirror that sent part of each
+                               // piece, atomic, NULL for a single URL
+} DLPieces;                    // per piece hashes of the file, see manifests
+
+typedef struct {
+  char *url;         // URL of the file
+  int priority;      // lower is preferred
+  char location[8];  // ISO 3166 country code of the server, may be empty
+} DLMetalinkURL;     // one URL of a Metalink
+
+typedef struct {
+  char *name;                     // name of the file, NULL if not given
+  curl_off_t size;                // length of the file, -1 if not given
+  const EVP_MD *hash_md;          // hash function of the whole file, or NULL
+  char hash[EVP_MAX_MD_SIZE * 2 + 1];  // hex digest of the whole file
+  const EVP_MD *piece_md;         // hash function of the pieces, or NULL
+  unsigned long long piece_size;  // bytes per piece
+  unsigned char *piece_hashes;    // hash of every piece
+  unsigned long long piece_count;  // number of piece hashes
+  DLMetalinkURL *urls;            // HTTP URLs of the file, preferred first
+  int url_count;                  // number of URLs
+} DLMetalink;                     // what a Metalink says about its first file
+
+typedef struct {
+  double checked;           // time of the last decision
+  curl_off_t bytes;         // bytes downloaded at the last decision
+  double best_rate;         // rate before the last added connection
+  bool settled;             // the last added connection did not help
+  double settled_at;        // when the controller stopped adding
+  double rate;              // total rate over the last interval
+  double peak_rate;         // best total rate seen
+  int peak_conns;           // connections allowed when it was seen
+} DLController;             // AIMD controller of the connection count
+
+typedef enum {
+  MIRROR_UNCHECKED,  // not compared with the first URL yet
+  MIRROR_OK,         // takes transfers
+  MIRROR_DEMOTED,    // failing or slow, takes no transfers for a while
+  MIRROR_BAD,        // serves a different file, never used
+} DLMirrorState;     // whether a mirror is used
+
+typedef struct {
+  char *url;             // URL of the file on the mirror
+  DLMirrorState state;   // whether it takes transfers
+  int active;            // connections downloading from it
+  curl_off_t bytes;      // bytes received from it, atomic
+  curl_off_t measured;   // bytes at the last rate measurement
+  double rate;           // smoothed bytes per second of one connection
+  int samples;           // measurements that went into rate
+  int errors;            // failed tries in a row
+  double demoted_at;     // when it was last demoted
+} DLMirror;              // one of the URLs the file is downloaded from
+
+typedef struct {
+  char host[256];           // host and port the profile is for
+  int conns;                // connections that gave the best total rate
+  double rate;              // bytes per second one connection managed
+  double rtt;               // seconds to set up a TCP connection
+  unsigned long long unit;  // smallest work unit worth a request
+  int ranges;               // 1 if Range is honored, 0 if not, -1 unknown
+  time_t saved;             // when the profile was learned
+  bool loaded;              // a fresh profile was found for this run
+} DLProfile;                // what earlier runs learned about a host
+
+typedef enum {
+  FILE_PENDING,  // waiting for a batch worker
+  FILE_ACTIVE,   // being downloaded by a batch worker
+  FILE_DONE,     // downloaded
+  FILE_LARGE,    // too big for one connection, split after the small files
+  FILE_FAILED,   // could not be downloaded
+} DLFileState;   // how far a file of the batch has come
+
+typedef struct {
+  char *url;          // URL to download from
+  char *filename;     // path to save to
+  int host;           // index of its host in the batch's hosts
+  DLFileState state;  // how far the file has come
+} DLBatchFile;        // one line of the batch list
+
+typedef struct {
+  char name[256];  // host and port
+  int active;      // batch workers downloading from it
+  int *files;      // indexes of its files, in list order
+  int file_count;  // number of its files
+  int next;        // next of its files to hand out
+} DLBatchHost;     // files and connections in use per host
+
+typedef struct {
+  DLBatchFile *files;     // every file of the list, in list order
+  int count;              // number of files
+  DLBatchHost *hosts;     // hosts of the list
+  int host_count;         // number of hosts
+  int finished;           // files done, failed or put aside as large
+  curl_off_t bytes;       // bytes of small files received, atomic
+  pthread_mutex_t mutex;  // mutex for file states and host counts
+  pthread_cond_t cond;    // wakes workers waiting for a host to have room
+} DLBatch;                // list of files downloaded by one process
+
+typedef struct {
+  pthread_t thread;    // thread handle
+  CURL *curl;          // reused from file to file, so connections stay open
+  DLBatchFile *file;   // file being downloaded
+  int fd;              // output file, opened with the first byte
+  curl_off_t length;   // length of the whole file, -1 if unknown
+  bool large;          // the file turned out too big for one connection
+  char errbuf[CURL_ERROR_SIZE];  // error message of the last transfer
+} DLBatchWorker;       // connection downloading small files of the batch
+
+typedef struct {
+  char *memory;           // backing memory of all buffers, block aligned
+  char **free;            // stack of buffers not in use
+  int free_count;         // number of free buffers
+  pthread_mutex_t mutex;  // mutex for the free stack
+  pthread_cond_t cond;    // wakes threads waiting for a buffer
+} DLBufferPool;           // fixed pool of aligned buffers for O_DIRECT
+
+/* ===============================================================
+                          DEFS and GLOBALS
+=============================================================== */
+#define DEFAULT_MAX_THREADS 4
+#define MAX_THREADS 32       // upper bound for -n with a thread per connection
+#define MAX_LOOP_CONNS 256   // upper bound for -n with --loops
+#define OPEN_END (ULLONG_MAX - 1)  // end of the first range, before the
+                                   // length is known
+#define UNITS_PER_THREAD 8                   // work units queued per thread
+#define MIN_UNIT_SIZE (1024 * 1024)          // smallest work unit handed out
+#define JOURNAL_BLOCK_SIZE (256 * 1024)      // resume bookkeeping unit, ranges
+                                             // start on block boundaries
+#define MIN_STEAL_SIZE JOURNAL_BLOCK_SIZE    // smallest range a thief takes
+#define CHECKPOINT_BYTES (16 * 1024 * 1024)  // bytes between thread flushes
+#define JOURNAL_INTERVAL 2.0                 // seconds between journal saves
+#define JOURNAL_SUFFIX ".mtdown"             // appended to the output name
+#define RETRY_TRIES 5          // failed attempts in a row before giving up
+#define RETRY_BASE_MS 250      // backoff after the first failure
+#define RETRY_MAX_MS 16000     // backoff never grows past this
+#define DEFAULT_HEDGE_CONNS 2                     // hedges running at once
+#define DEFAULT_HEDGE_BYTES (16ULL * 1024 * 1024)  // bytes hedges may repeat
+#define HEDGE_FACTOR 4.0     // how far behind a range must be to be hedged
+#define HEDGE_MIN_ETA 2.0    // seconds left before a range is worth hedging
+#define HEDGE_POLL_US 200000  // how often idle threads look for stragglers
+#define INITIAL_CONNS 2       // connections allowed to take work at first
+#define CONTROL_INTERVAL 1.0  // seconds between connection count decisions
+#define CONTROL_GAIN 0.05     // rate increase that justifies a connection
+#define CONTROL_PROBE 10.0    // seconds settled before trying one more
+#define PROFILE_TTL (24 * 60 * 60)  // seconds a host profile stays valid
+#define PROFILE_UNIT_RTTS 20  // a work unit should take this many RTTs
+#define THROTTLE_BURST 0.25  // seconds of data a connection may run ahead of a
+                             // speed limit
+#define THROTTLE_STEP 1.25   // factor a key press or signal changes limits by
+#define DEFAULT_SMALL_SIZE (4ULL * 1024 * 1024)  // files up to this size are
+                                                // fetched with one request
+#define MIRROR_ERRORS 3       // failed tries in a row that demote a mirror
+#define MIRROR_SLOW 4.0       // how far behind the fastest a mirror is demoted
+#define MIRROR_SAMPLES 3      // measurements before a mirror can be slow
+#define MIRROR_SMOOTHING 0.3  // weight of the newest rate measurement
+#define MIRROR_PENALTY 30.0   // seconds a demoted mirror is left alone
+#define HTTP2_BUFFER_SIZE (512L * 1024)  // receive buffer of an HTTP/2 stream
+#define MAX_LOOPS 16         // upper bound for --loops
+#define LOOP_EVENTS 64       // socket events handled per epoll_wait
+#define LOOP_TICK_MS 100     // longest a loop sleeps before checking on state
+#define URING_BUFFERS 16                // registered buffers per thread
+#define URING_BUFFER_SIZE (256 * 1024)  // size of each registered buffer
+#define URING_BATCH 4                   // writes queued before submitting
+#define DEFAULT_WRITERS 1                  // writer threads for IO_THREAD
+#define WRITER_SLOTS 256                   // queue slots per writer thread
+#define WRITER_SLOT_SIZE CURL_MAX_WRITE_SIZE  // largest chunk curl hands us
+#define WRITER_BATCH 64                    // slots drained per pwritev
+#define WRITER_IDLE_MS 10                  // writer wait when queue is empty
+#define DIRECT_BUFFER_SIZE (1024 * 1024)   // size of each O_DIRECT buffer
+#define DEFAULT_DIRECT_POOL (32 * 1024 * 1024)  // memory for O_DIRECT buffers
+#define DEFAULT_REORDER_BUFFER (64 * 1024 * 1024)  // memory for data streamed
+                                                   // out of order
+#define STREAM_SPILL_MAX (4ULL * 1024 * 1024 * 1024)  // how far past the
+                                                      // buffer ranges may run
+#define STREAM_POLL_US 20000  // flusher wait when nothing is ready
+#define DIGEST_CHUNK (1024 * 1024)  // bytes hashed per read of the file
+#define DEFAULT_PIECE_SIZE (4 * 1024 * 1024)  // bytes per piece of a manifest
+#define PIECE_TRIES 3  // times a piece may not match before giving up
+#define METALINK_NO_PRIORITY 999999  // priority of a URL that has none
+#define CLEAR_SCREEN "\033[2J\033[1;1H"
+#define CHECKMARK "\u2713"
+#define CROSSMARK "\u2717"
+#define BOLD "\033[1m"
+#define RESET "\033[0m"
+#define RED "\033[31m"
+#define GREEN "\033[32m"
+#define YELLOW "\033[33m"
+#define CYAN "\033[36m"
+#define WHITE "\033[37m"
+#define GREY "\033[90m"
+
+DLThreadInfo **thread_infos;      // global array of thread_infos
+DLProgress progress;              // global progress
+DLSettings settings;              // global settings
+DLScheduler scheduler;            // global work queue
+curl_off_t content_length;        // size of the file being downloaded
+char remote_validator[1024];      // ETag or Last-Modified of the remote file
+int output_fd = -1;               // descriptor all threads write into
+DLWriter *writers;                // writer threads for IO_THREAD
+char *output_map;                 // mapping of the whole file for IO_MMAP
+int direct_fd = -1;               // O_DIRECT descriptor for IO_DIRECT
+size_t direct_align;              // alignment O_DIRECT writes need
+DLBufferPool direct_pool;         // buffers threads fill for IO_DIRECT
+DLJournal journal;                // global resume journal
+DLStream stream = {.fd = -1};     // stdout output for -o -
+DLDigest digest;                  // checksum of the file for --sha256 and co
+DLPieces pieces;                  // piece hashes for manifests
+DLMetalink metalink;              // file described by --metalink
+DLLoop *loops;                    // event loops when settings.loops > 0
+DLController controller;          // decides how many connections to use
+DLProfile profile;                // learned tuning for the URL's host
+DLBucket bandwidth;               // speed limit shared by all connections
+bool rate_limited;                // a speed limit was in force at some point
+int rate_signal;                  // limit changes asked for by signals, atomic
+CURLSH *share;                    // DNS and TLS session cache of all handles
+pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];  // one per shared cache
+int window_width;                 // terminal width
+int window_height;                // terminal height
+char log_buffer[2048];            // buffer to store logs from threads
+pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;  // mutex for logs
+pthread_mutex_t completed_mutex;  // mutex for completed_counter
+int completed_counter = 0;        // counter for completed threads
+time_t start_time;                // start time of download
+bool paused;                      // whether download is paused
+bool cancelled;                   // the user quit
+bool overwrite_ok;                // existing files are overwritten without
+                                  // asking
+DLBatch batch;                    // files of batch mode
+DLMirror *mirrors;                // URLs the file is downloaded from
+int mirror_count;                 // number of mirrors
+pthread_mutex_t mirror_mutex = PTHREAD_MUTEX_INITIALIZER;  // mutex for mirrors
+
+/* ===============================================================
+                      RENDERING and INTERFACE
+=============================================================== */
+// Calculate width and print at center
+void print_center(char *str) {
+  int padding = (window_width - strlen(str)) / 2;
+  printf("%*s", padding, "");
+  printf("%s", str);
+}
+
+// Print header based on screen size
+void print_header() {
+  for (int i = 0; i < window_width; i++) {
+    printf("=");
+  }
+  printf(RESET "\n\n" BOLD RED);
+  print_center("MULTI-THREADED DOWNLOADER");
+  printf("\n" RESET CYAN);
+  print_center("by Huy Ngo");
+  printf("\n\n" RESET);
+  for (int i = 0; i < window_width; i++) {
+    printf("=");
+  }
+  printf("\n\n" RESET);
+}
+
+// Print download info
+void print_download_info() {
+  printf(BOLD);
+  print_center("[ Download Info ]");
+  printf("\n\n" RESET CYAN BOLD);
+  print_center(settings.url);
+  printf("\n" GREEN);
+  print_center(settings.filename);
+  printf("\n\n" RESET);
+}
+
+// Clear screen
+void clear_screen() { system("clear"); }
+
+// Append a line to the log buffer, dropping the oldest lines when it is full
+void add_log(char *log) {
+  pthread_mutex_lock(&log_mutex);
+  size_t len = strlen(log);
+  while (strlen(log_buffer) + len >= sizeof(log_buffer)) {
+    char *next = strchr(log_buffer, '\n');
+    if (next == NULL) {
+      log_buffer[0] = '\0';
+      break;
+    }
+    memmove(log_buffer, next + 1, strlen(next + 1) + 1);
+  }
+  if (len < sizeof(log_buffer)) strcat(log_buffer, log);
+  pthread_mutex_unlock(&log_mutex);
+}
+
+// Get monotonic time in seconds, used to measure transfer rates
+double get_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Add to a thread's progress. Call with the thread's args->lock held, so
+// there is one writer at a time and the sequence number is a seqlock
+void stats_add(int index, curl_off_t downloaded, curl_off_t total,
+               curl_off_t retries) {
+  DLStats *stats = &progress.threads[index];
+  __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&stats->downloaded_bytes,
+                   stats->downloaded_bytes + downloaded, __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->total_bytes, stats->total_bytes + total,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->retries, stats->retries + retries,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&stats->seq, stats->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Copy a thread's progress without taking its lock, reading again while the
+// thread is in the middle of changing it
+DLStats stats_read(int index) {
+  DLStats *stats = &progress.threads[index];
+  DLStats copy;
+  while (true) {
+    copy.seq = __atomic_load_n(&stats->seq, __ATOMIC_ACQUIRE);
+    copy.total_bytes = __atomic_load_n(&stats->total_bytes, __ATOMIC_RELAXED);
+    copy.downloaded_bytes =
+        __atomic_load_n(&stats->downloaded_bytes, __ATOMIC_RELAXED);
+    copy.retries = __atomic_load_n(&stats->retries, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (copy.seq % 2 == 0 &&
+        copy.seq == __atomic_load_n(&stats->seq, __ATOMIC_RELAXED))
+      break;
+    sched_yield();
+  }
+  copy.rate = stats->rate;
+  copy.measured = stats->measured;
+  return copy;
+}
+
+// Bytes downloaded by all threads so far
+curl_off_t stats_downloaded() {
+  curl_off_t downloaded = 0;
+  for (int i = 0; i < settings.max_threads; i++)
+    downloaded += stats_read(i).downloaded_bytes;
+  return downloaded;
+}
+
+/* ===============================================================
+                          RESUME JOURNAL
+=============================================================== */
+// Set up an empty journal for a file of the given length
+void journal_init(curl_off_t length, char *validator) {
+  journal.path = malloc(strlen(settings.filename) + strlen(JOURNAL_SUFFIX) + 1);
+  journal.blocks = (length + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE;
+  journal.bitmap = calloc((journal.blocks + 7) / 8, 1);
+  journal.validator = strdup(validator ? validator : "");
+
+  // Check error
+  if (journal.path == NULL || journal.bitmap == NULL ||
+      journal.validator == NULL) {
+    printf("ERROR | Could not allocate journal\n");
+    exit(EXIT_FAILURE);
+  }
+
+  sprintf(journal.path, "%s%s", settings.filename, JOURNAL_SUFFIX);
+  journal.saved = get_time();
+  pthread_mutex_init(&journal.mutex, NULL);
+}
+
+// Whether a block is in the file
+bool journal_has(unsigned long long block) {
+  return journal.bitmap[block / 8] & (1 << (block % 8));
+}
+
+// Grow the list of merged ranges if one more would not fit, call with
+// journal.mutex held
+bool journal_reserve() {
+  if (journal.done_count < journal.done_capacity) return true;
+  int capacity = journal.done_capacity ? journal.done_capacity * 2 : 64;
+  DLRange *done = realloc(journal.done, capacity * sizeof(DLRange));
+  if (done == NULL) return false;
+  journal.done = done;
+  journal.done_capacity = capacity;
+  return true;
+}
+
+// Record that bytes start to end - 1 are in the file, marking every block
+// the merged range now fully covers
+void journal_add(unsigned long long start, unsigned long long end) {
+  if (end <= start) return;
+  pthread_mutex_lock(&journal.mutex);
+
+  // Grow the list of merged ranges if needed
+  if (!journal_reserve()) {
+    pthread_mutex_unlock(&journal.mutex);
+    return;
+  }
+
+  // Merge with every range it touches, ranges here are end exclusive
+  unsigned long long added_start = start;
+  unsigned long long added_end = end;
+  int i = 0;
+  while (i < journal.done_count) {
+    DLRange *done = &journal.done[i];
+    if (done->end < start || done->start > end) {
+      i++;
+      continue;
+    }
+    if (done->start < start) start = done->start;
+    if (done->end > end) end = done->end;
+    journal.done[i] = journal.done[--journal.done_count];
+  }
+  journal.done[journal.done_count].start = start;
+  journal.done[journal.done_count].end = end;
+  journal.done_count++;
+
+  // Mark the blocks touched by the new bytes that the merged range now covers
+  // completely
+  unsigned long long last = (added_end - 1) / JOURNAL_BLOCK_SIZE;
+  for (unsigned long long b = added_start / JOURNAL_BLOCK_SIZE; b <= last; b++) {
+    unsigned long long block_end = (b + 1) * JOURNAL_BLOCK_SIZE;
+    if (block_end > (unsigned long long)content_length)
+      block_end = content_length;
+    if (b * JOURNAL_BLOCK_SIZE >= start && block_end <= end)
+      journal.bitmap[b / 8] |= 1 << (b % 8);
+  }
+
+  pthread_mutex_unlock(&journal.mutex);
+}
+
+// Forget that the blocks from start to end - 1 are in the file, for data that
+// turned out to be wrong. Both ends are on block boundaries
+bool journal_drop(unsigned long long start, unsigned long long end) {
+  pthread_mutex_lock(&journal.mutex);
+
+  // At most one range reaches past both ends and is cut in two
+  if (!journal_reserve()) {
+    pthread_mutex_unlock(&journal.mutex);
+    return false;
+  }
+
+  int i = 0;
+  int count = journal.done_count;
+  while (i < count) {
+    DLRange *done = &journal.done[i];
+    if (done->end <= start || done->start >= end) {
+      i++;
+      continue;
+    }
+    if (done->end > end) {
+      journal.done[journal.done_count].start = end;
+      journal.done[journal.done_count].end = done->end;
+      journal.done_count++;
+    }
+    if (done->start < start) {
+      done->end = start;
+      i++;
+      continue;
+    }
+    journal.done[i] = journal.done[--journal.done_count];
+    if (journal.done_count < count) count--;
+  }
+
+  for (unsigned long long b = start / JOURNAL_BLOCK_SIZE;
+       b * JOURNAL_BLOCK_SIZE < end; b++)
+    journal.bitmap[b / 8] &= ~(1 << (b % 8));
+
+  pthread_mutex_unlock(&journal.mutex);
+  return true;
+}
+
+// Whether every block is in the file
+bool journal_complete() {
+  for (unsigned long long b = 0; b < journal.blocks; b++)
+    if (!journal_has(b)) return false;
+  return true;
+}
+
+// Load the journal left by an earlier run, returns false if there is none or
+// it belongs to a different file or a different version of it
+bool journal_load(curl_off_t length, char *validator) {
+  FILE *file = fopen(journal.path, "rb");
+  if (file == NULL) return false;
+
+  char line[4096];
+  char url[4096] = "";
+  char saved_validator[4096] = "";
+  unsigned long long saved_length = 0;
+  unsigned long long block_size = 0;
+  bool valid = fgets(line, sizeof(line), file) && strcmp(line, "MTDOWN 1\n") == 0;
+
+  // Read the header up to the empty line before the bitmap
+  while (valid && fgets(line, sizeof(line), file) && strcmp(line, "\n") != 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "url=", 4) == 0)
+      snprintf(url, sizeof(url), "%s", line + 4);
+    else if (strncmp(line, "validator=", 10) == 0)
+      snprintf(saved_validator, sizeof(saved_validator), "%s", line + 10);
+    else if (strncmp(line, "length=", 7) == 0)
+      saved_length = strtoull(line + 7, NULL, 10);
+    else if (strncmp(line, "block=", 6) == 0)
+      block_size = strtoull(line + 6, NULL, 10);
+  }
+
+  // Only resume the same URL, length and validator, without a validator the
+  // server could have changed the file under us
+  valid = valid && strcmp(url, settings.url) == 0 &&
+          saved_length == (unsigned long long)length &&
+          block_size == JOURNAL_BLOCK_SIZE && validator != NULL && *validator &&
+          strcmp(saved_validator, validator) == 0;
+  size_t bitmap_size = (journal.blocks + 7) / 8;
+  valid = valid && fread(journal.bitmap, 1, bitmap_size, file) == bitmap_size;
+  fclose(file);
+
+  if (!valid) {
+    memset(journal.bitmap, 0, bitmap_size);
+    return false;
+  }
+
+  // Rebuild the merged ranges from the bitmap
+  for (unsigned long long b = 0; b < journal.blocks; b++) {
+    if (!journal_has(b)) continue;
+    unsigned long long end = (b + 1) * JOURNAL_BLOCK_SIZE;
+    if (end > (unsigned long long)length) end = length;
+    journal_add(b * JOURNAL_BLOCK_SIZE, end);
+    journal.resumed_bytes += end - b * JOURNAL_BLOCK_SIZE;
+  }
+  return true;
+}
+
+// Write the bitmap to a temporary file and move it over the journal, so a
+// crash while saving leaves the previous journal intact
+bool journal_write(unsigned char *bitmap) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", journal.path);
+
+  FILE *file = fopen(tmp, "wb");
+  if (file == NULL) return false;
+
+  fprintf(file, "MTDOWN 1\nurl=%s\nlength=%lld\nvalidator=%s\nblock=%d\n\n",
+          settings.url, (long long)content_length, journal.validator,
+          JOURNAL_BLOCK_SIZE);
+  fwrite(bitmap, 1, (journal.blocks + 7) / 8, file);
+
+  bool ok = fflush(file) == 0 && fsync(fileno(file)) == 0;
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(tmp, journal.path) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+// Count the part of each range that threads have flushed so far
+void journal_collect() {
+  pthread_mutex_lock(&scheduler.mutex);
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLThreadArgs *args = thread_infos[i]->args;
+    pthread_mutex_lock(&args->lock);
+    unsigned long long start = args->start;
+    unsigned long long durable = args->durable;
+    pthread_mutex_unlock(&args->lock);
+    journal_add(start, durable);
+  }
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+// End of the bytes known to be in the file without a gap from offset on,
+// offset itself if it is missing
+unsigned long long journal_contiguous(unsigned long long offset) {
+  unsigned long long end = offset;
+  pthread_mutex_lock(&journal.mutex);
+  for (int i = 0; i < journal.done_count; i++)
+    if (journal.done[i].start <= offset && journal.done[i].end > end)
+      end = journal.done[i].end;
+  pthread_mutex_unlock(&journal.mutex);
+  return end;
+}
+
+// Record how far every thread has written, make that data durable and save
+// the journal, only once every JOURNAL_INTERVAL unless forced. A stream
+// cannot be resumed, nothing is saved for it
+void journal_checkpoint(bool force) {
+  if (journal.bitmap == NULL || settings.io_mode == IO_STREAM) return;
+  if (!force && get_time() - journal.saved < JOURNAL_INTERVAL) return;
+  journal.saved = get_time();
+
+  journal_collect();
+
+  // Copy the bitmap first, everything it marks has already been handed to
+  // the kernel, so syncing the file afterwards makes all of it durable
+  size_t bitmap_size = (journal.blocks + 7) / 8;
+  unsigned char *bitmap = malloc(bitmap_size);
+  if (bitmap == NULL) return;
+  pthread_mutex_lock(&journal.mutex);
+  memcpy(bitmap, journal.bitmap, bitmap_size);
+  pthread_mutex_unlock(&journal.mutex);
+
+  if (fdatasync(output_fd) == 0 && !journal_write(bitmap)) {
+    char log[256];
+    snprintf(log, sizeof(log),
+             RED "ERROR | Could not save journal %s\n" RESET, journal.path);
+    add_log(log);
+  }
+  free(bitmap);
+}
+
+// Remove the journal once the download is complete
+void journal_remove() {
+  if (journal.path) unlink(journal.path);
+}
+
+/* ===============================================================
+                          HOST PROFILES
+=============================================================== */
+// Path of the profile cache, under $XDG_CACHE_HOME or ~/.cache, creating the
+// directories if needed
+bool profile_path(char *path, size_t size) {
+  char dir[4096];
+  char *cache = getenv("XDG_CACHE_HOME");
+  char *home = getenv("HOME");
+  if (cache != NULL && *cache)
+    snprintf(dir, sizeof(dir), "%s", cache);
+  else if (home != NULL && *home)
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+  else
+    return false;
+
+  mkdir(dir, 0755);
+  snprintf(path, size, "%s/mtdown", dir);
+  mkdir(path, 0755);
+  snprintf(path, size, "%s/mtdown/hosts", dir);
+  return true;
+}
+
+// Write the host and port of a URL, which profiles and batch host limits are
+// keyed by, returns false for a URL curl cannot parse
+bool url_host(char *address, char *buf, size_t size) {
+  CURLU *url = curl_url();
+  char *host = NULL;
+  char *port = NULL;
+  bool parsed =
+      curl_url_set(url, CURLUPART_URL, address, 0) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_HOST, &host, 0) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_PORT, &port, CURLU_DEFAULT_PORT) ==
+          CURLUE_OK;
+  if (parsed) snprintf(buf, size, "%s:%s", host, port);
+  curl_free(host);
+  curl_free(port);
+  curl_url_cleanup(url);
+  return parsed;
+}
+
+// Load the profile of the URL's host if an earlier run saved one that has not
+// expired, profiles are kept one per line as
+// <host> <conns> <rate> <rtt> <unit> <ranges> <saved>
+void profile_load() {
+  profile.ranges = -1;
+  url_host(settings.url, profile.host, sizeof(profile.host));
+
+  char path[4096];
+  if (!*profile.host || !profile_path(path, sizeof(path))) return;
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return;
+
+  char line[512];
+  char key[256];
+  DLProfile saved;
+  long long saved_time;
+  while (fgets(line, sizeof(line), file)) {
+    if (sscanf(line, "%255s %d %lf %lf %llu %d %lld", key, &saved.conns,
+               &saved.rate, &saved.rtt, &saved.unit, &saved.ranges,
+               &saved_time) != 7 ||
+        strcmp(key, profile.host) != 0 ||
+        time(NULL) - saved_time > PROFILE_TTL || saved.conns < 1)
+      continue;
+
+    profile.conns = saved.conns;
+    profile.rate = saved.rate;
+    profile.rtt = saved.rtt;
+    profile.unit = saved.unit;
+    profile.ranges = saved.ranges;
+    profile.saved = saved_time;
+    profile.loaded = true;
+  }
+  fclose(file);
+}
+
+// Save what this run learned about the host, replacing its old line and
+// dropping expired ones, through a temporary file so concurrent runs never
+// see half a cache
+void profile_save() {
+  // Rates measured under our own speed limit, or spread over mirrors, say
+  // nothing about the host
+  if (!*profile.host || rate_limited || mirror_count > 1) return;
+
+  // A host that ignores Range is worth remembering even when the download was
+  // too short to measure anything
+  if (controller.peak_conns < 1 && profile.ranges != 0) return;
+
+  profile.conns = controller.peak_conns > 0 ? controller.peak_conns : 1;
+  profile.rate = controller.peak_rate / profile.conns;
+  profile.unit = profile.rate * profile.rtt * PROFILE_UNIT_RTTS;
+  profile.saved = time(NULL);
+
+  char path[4096];
+  char tmp[4200];
+  if (!profile_path(path, sizeof(path))) return;
+  snprintf(tmp, sizeof(tmp), "%s.%d", path, getpid());
+
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL) return;
+
+  FILE *in = fopen(path, "r");
+  char line[512];
+  char key[256];
+  long long saved_time;
+  while (in != NULL && fgets(line, sizeof(line), in)) {
+    if (sscanf(line, "%255s %*d %*f %*f %*u %*d %lld", key, &saved_time) !=
+            2 ||
+        strcmp(key, profile.host) == 0 ||
+        time(NULL) - saved_time > PROFILE_TTL)
+      continue;
+    fputs(line, out);
+  }
+  if (in != NULL) fclose(in);
+
+  fprintf(out, "%s %d %.0f %.6f %llu %d %lld\n", profile.host, profile.conns,
+          profile.rate, profile.rtt, profile.unit, profile.ranges,
+          (long long)profile.saved);
+  if (fclose(out) != 0 || rename(tmp, path) != 0) unlink(tmp);
+}
+
+/* ===============================================================
+                          WORK SCHEDULING
+=============================================================== */
+// Number of bytes left in a thread's current range, call with args->lock held
+unsigned long long range_remaining(DLThreadArgs *args) {
+  if (args->abandoned) return 0;
+  return args->pos > args->end ? 0 : args->end - args->pos + 1;
+}
+
+// Cut the missing part of the file into many small work units so fast threads
+// can take more of them instead of waiting on the slowest one, every unit
+// starts on a block boundary
+void setup_scheduler(curl_off_t length) {
+  // Aim for a few units per thread, but never cut them too small
+  curl_off_t missing =
+      length - __atomic_load_n(&journal.resumed_bytes, __ATOMIC_RELAXED);
+  unsigned long long unit_size =
+      missing / (settings.max_threads * UNITS_PER_THREAD);
+  if (unit_size < MIN_UNIT_SIZE) unit_size = MIN_UNIT_SIZE;
+  if (unit_size < profile.unit) unit_size = profile.unit;
+  unit_size = (unit_size + JOURNAL_BLOCK_SIZE - 1) / JOURNAL_BLOCK_SIZE * JOURNAL_BLOCK_SIZE;
+
+  // Walk the runs of blocks not in the journal twice, once to count the
+  // units and once to fill them in
+  for (int pass = 0; pass < 2; pass++) {
+    int count = 0;
+    unsigned long long b = 0;
+    while (b < journal.blocks) {
+      if (journal_has(b)) {
+        b++;
+        continue;
+      }
+      unsigned long long start = b * JOURNAL_BLOCK_SIZE;
+      while (b < journal.blocks && !journal_has(b)) b++;
+      unsigned long long end = b * JOURNAL_BLOCK_SIZE;
+      if (end > (unsigned long long)length) end = length;
+
+      for (; start < end; start += unit_size) {
+        if (pass == 1) {
+          scheduler.units[count].start = start;
+          scheduler.units[count].end =
+              start + unit_size < end ? start + unit_size - 1 : end - 1;
+        }
+        count++;
+      }
+    }
+
+    if (pass == 0) {
+      scheduler.unit_count = count;
+      scheduler.units = malloc(sizeof(DLRange) * (count ? count : 1));
+
+      // Check error
+      if (scheduler.units == NULL) {
+        printf("ERROR | Could not allocate work units\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // Every thread holds at most one range, so it can give back at most one
+  scheduler.returned = malloc(sizeof(DLRange) * settings.max_threads);
+
+  // Check error
+  if (scheduler.returned == NULL) {
+    printf("ERROR | Could not allocate work units\n");
+    exit(EXIT_FAILURE);
+  }
+
+  scheduler.next_unit = 0;
+  scheduler.returned_count = 0;
+  scheduler.started = get_time();
+}
+
+// Hand a new range to a thread
+void assign_range(DLThreadArgs *args, unsigned long long start,
+                  unsigned long long end) {
+  pthread_mutex_lock(&args->lock);
+  args->start = start;
+  args->end = end;
+  args->pos = start;
+  args->durable = start;
+  args->started = get_time();
+  args->abandoned = false;
+  stats_add(args->index, 0, end - start + 1, 0);
+  pthread_mutex_unlock(&args->lock);
+}
+
+// Stop the losing side of a hedge and take its duplicated bytes back out of
+// its progress, call with scheduler.mutex held
+void abandon_range(DLThreadArgs *loser) {
+  pthread_mutex_lock(&loser->lock);
+  unsigned long long duplicated =
+      loser->pos > loser->hedge_from ? loser->pos - loser->hedge_from : 0;
+  stats_add(loser->index, -(curl_off_t)duplicated,
+            -(curl_off_t)(loser->end - loser->hedge_from + 1), 0);
+  loser->abandoned = true;
+  loser->partner = NULL;
+  pthread_mutex_unlock(&loser->lock);
+}
+
+// Called when a thread is done with its range, what it wrote goes into the
+// journal and if it was hedged the partner lost the race and is stopped, call
+// with scheduler.mutex held
+void finish_range(DLThreadArgs *args) {
+  journal_add(args->start, args->durable);
+
+  if (args->partner == NULL) return;
+
+  // Add hedge result to log
+  char log[256];
+  snprintf(log, sizeof(log),
+           GREY " INFO | Thread %d finished bytes %llu-%llu first, stopping "
+                "thread %d.\n" RESET,
+           args->index, args->hedge_from, args->end, args->partner->index);
+  add_log(log);
+
+  abandon_range(args->partner);
+  args->partner = NULL;
+  scheduler.hedges_active--;
+}
+
+// Take the tail half of the busiest thread's remaining range, call with
+// scheduler.mutex held so thieves do not race each other
+bool steal_range(DLThreadArgs *thief) {
+  // Find the thread with the most bytes left, or for a stream the one nearest
+  // the flush point that is still worth splitting
+  DLThreadArgs *victim = NULL;
+  unsigned long long most = 0;
+  unsigned long long nearest = 0;
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLThreadArgs *args = thread_infos[i]->args;
+    if (args == thief || args->partner != NULL) continue;
+
+    pthread_mutex_lock(&args->lock);
+    unsigned long long remaining = range_remaining(args);
+    unsigned long long pos = args->pos;
+    pthread_mutex_unlock(&args->lock);
+
+    bool better = settings.io_mode == IO_STREAM
+                      ? remaining >= 2 * MIN_STEAL_SIZE &&
+                            (victim == NULL || pos < nearest)
+                      : remaining > most;
+    if (better) {
+      most = remaining;
+      nearest = pos;
+      victim = args;
+    }
+  }
+
+  // Not worth splitting, let the owner finish it
+  if (victim == NULL || most < 2 * MIN_STEAL_SIZE) return false;
+
+  // Split what is left at the midpoint, the victim's write callback stops at
+  // its new end
+  pthread_mutex_lock(&victim->lock);
+  unsigned long long remaining = range_remaining(victim);
+  if (remaining < 2 * MIN_STEAL_SIZE) {
+    pthread_mutex_unlock(&victim->lock);
+    return false;
+  }
+  unsigned long long mid = victim->pos + remaining / 2;
+  mid -= mid % JOURNAL_BLOCK_SIZE;
+  if (mid <= victim->pos) {
+    pthread_mutex_unlock(&victim->lock);
+    return false;
+  }
+  unsigned long long end = victim->end;
+  victim->end = mid - 1;
+  stats_add(victim->index, 0, -(curl_off_t)(end - mid + 1), 0);
+  pthread_mutex_unlock(&victim->lock);
+
+  assign_range(thief, mid, end);
+
+  return true;
+}
+
+// Start a second connection on the rest of the range whose projected finish
+// is furthest behind, call with scheduler.mutex held
+bool hedge_range(DLThreadArgs *hedger) {
+  // Stay within the hedging budget
+  if (scheduler.hedges_active >= settings.hedge_conns) return false;
+
+  // Expected rate of a fresh connection, averaged over the whole download
+  // and the connections the controller lets take work
+  double now = get_time();
+  curl_off_t downloaded = stats_downloaded();
+  int active = scheduler.conn_limit > 0 ? scheduler.conn_limit : 1;
+  double fresh_rate = downloaded / (now - scheduler.started + 1.0) / active;
+
+  // Find the range that is furthest behind what a fresh connection would do
+  DLThreadArgs *straggler = NULL;
+  double worst = 0;
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLThreadArgs *args = thread_infos[i]->args;
+    if (args == hedger || args->partner != NULL) continue;
+
+    pthread_mutex_lock(&args->lock);
+    unsigned long long remaining = range_remaining(args);
+    double rate = (args->pos - args->start) / (now - args->started + 0.001);
+    pthread_mutex_unlock(&args->lock);
+
+    if (remaining == 0) continue;
+    if (settings.hedge_bytes < scheduler.hedge_bytes + remaining) continue;
+
+    double eta = remaining / (rate + 1.0);
+    double fresh_eta = remaining / (fresh_rate + 1.0);
+    if (eta > HEDGE_MIN_ETA && eta > HEDGE_FACTOR * fresh_eta && eta > worst) {
+      worst = eta;
+      straggler = args;
+    }
+  }
+
+  if (straggler == NULL) return false;
+
+  // Both threads now race on the rest of the range, whoever gets to the end
+  // first stops the other in finish_range
+  pthread_mutex_lock(&straggler->lock);
+  unsigned long long from = straggler->pos;
+  unsigned long long end = straggler->end;
+  straggler->hedge_from = from;
+  straggler->partner = hedger;
+  pthread_mutex_unlock(&straggler->lock);
+
+  assign_range(hedger, from, end);
+  hedger->hedge_from = from;
+  hedger->partner = straggler;
+  scheduler.hedges_active++;
+  scheduler.hedge_bytes += end - from + 1;
+
+  // Add hedge to log
+  char log[256];
+  snprintf(log, sizeof(log),
+           YELLOW " INFO | Thread %d is slow, thread %d also fetching bytes "
+                  "%llu-%llu.\n" RESET,
+           straggler->index, hedger->index, from, end);
+  add_log(log);
+
+  return true;
+}
+
+// Put the rest of a thread's range back in the queue, for a thread that no
+// longer fits under the connection limit. Hedged ranges are kept since the
+// partner depends on them. Call with scheduler.mutex held
+bool return_range(DLThreadArgs *args) {
+  pthread_mutex_lock(&args->lock);
+  unsigned long long remaining = range_remaining(args);
+  bool returned = args->partner == NULL && remaining > 0;
+  if (returned) {
+    scheduler.returned[scheduler.returned_count].start = args->pos;
+    scheduler.returned[scheduler.returned_count].end = args->end;
+    scheduler.returned_count++;
+    stats_add(args->index, 0, -(curl_off_t)remaining, 0);
+    args->abandoned = true;
+  }
+  pthread_mutex_unlock(&args->lock);
+  return returned;
+}
+
+// Whether any thread other than args still has bytes to download, call with
+// scheduler.mutex held
+bool work_in_flight(DLThreadArgs *self) {
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLThreadArgs *args = thread_infos[i]->args;
+    if (args == self) continue;
+
+    pthread_mutex_lock(&args->lock);
+    unsigned long long remaining = range_remaining(args);
+    pthread_mutex_unlock(&args->lock);
+
+    if (remaining > 0) return true;
+  }
+  return false;
+}
+
+// Whether pieces are still to be checked against a manifest, any of them may
+// come back to be downloaded again. A stream cannot take a piece back
+bool pieces_pending() {
+  return pieces.expected != NULL && settings.io_mode != IO_STREAM &&
+         !pieces.failed && !digest.failed &&
+         __atomic_load_n(&pieces.checked, __ATOMIC_RELAXED) < pieces.count;
+}
+
+// Try once to give a thread a range, either the next unit in the queue or
+// half of another thread's range once the queue is empty. With nothing left
+// to split, the thread is told to wait while it could still hedge ranges that
+// fall behind, call with scheduler.mutex held
+DLTake take_range(DLThreadArgs *args) {
+  if (scheduler.stopping) return TAKE_NONE;
+
+  // Until the file is set up there is only the first ranged GET, which asks
+  // for everything from byte 0 since the length is not known yet
+  if (scheduler.sizing != SIZE_READY) {
+    if (scheduler.sizing != SIZE_PENDING || scheduler.first != NULL)
+      return TAKE_WAIT;
+    scheduler.first = args;
+    pthread_mutex_lock(&args->lock);
+    args->start = 0;
+    args->end = OPEN_END;
+    args->pos = 0;
+    args->durable = 0;
+    args->started = get_time();
+    args->abandoned = false;
+    pthread_mutex_unlock(&args->lock);
+    return TAKE_FOUND;
+  }
+
+  // Threads over the connection limit wait until the controller lets them in
+  // or there is nothing left to do
+  bool queued = scheduler.returned_count > 0 ||
+                scheduler.next_unit < scheduler.unit_count;
+  if (args->index >= scheduler.conn_limit)
+    return queued || work_in_flight(args) || pieces_pending() ? TAKE_WAIT
+                                                               : TAKE_NONE;
+
+  // Without Range, one transfer takes everything from the lowest missing byte
+  // to the end, bytes already in the file between are simply written again
+  if (scheduler.single) {
+    if (!queued)
+      return work_in_flight(args) || pieces_pending() ? TAKE_WAIT : TAKE_NONE;
+    unsigned long long start = content_length;
+    for (int i = 0; i < scheduler.returned_count; i++)
+      if (scheduler.returned[i].start < start)
+        start = scheduler.returned[i].start;
+    if (scheduler.next_unit < scheduler.unit_count &&
+        scheduler.units[scheduler.next_unit].start < start)
+      start = scheduler.units[scheduler.next_unit].start;
+    scheduler.returned_count = 0;
+    scheduler.next_unit = scheduler.unit_count;
+    assign_range(args, start, content_length - 1);
+    return TAKE_FOUND;
+  }
+
+  if (scheduler.returned_count > 0) {
+    // A stream wants the range nearest the flush point back first
+    int pick = scheduler.returned_count - 1;
+    for (int i = 0; settings.io_mode == IO_STREAM && i < pick; i++)
+      if (scheduler.returned[i].start < scheduler.returned[pick].start)
+        pick = i;
+    DLRange range = scheduler.returned[pick];
+    scheduler.returned[pick] = scheduler.returned[--scheduler.returned_count];
+    assign_range(args, range.start, range.end);
+    return TAKE_FOUND;
+  }
+  if (scheduler.next_unit < scheduler.unit_count) {
+    DLRange unit = scheduler.units[scheduler.next_unit];
+
+    // A stream only runs so far ahead of what is written out, the thread
+    // waits for the flush point to catch up
+    if (settings.io_mode == IO_STREAM &&
+        unit.start >= __atomic_load_n(&stream.flushed, __ATOMIC_RELAXED) +
+                          stream.size + STREAM_SPILL_MAX)
+      return TAKE_WAIT;
+
+    scheduler.next_unit++;
+    assign_range(args, unit.start, unit.end);
+    return TAKE_FOUND;
+  }
+  if (steal_range(args) || hedge_range(args)) return TAKE_FOUND;
+  if (pieces_pending()) return TAKE_WAIT;
+  if (settings.hedge_conns == 0 || !work_in_flight(args)) return TAKE_NONE;
+  return TAKE_WAIT;
+}
+
+// Finish the thread's range and block until it has a new one, returns false
+// once there is no work left
+bool next_range(DLThreadArgs *args) {
+  pthread_mutex_lock(&scheduler.mutex);
+
+  finish_range(args);
+
+  DLTake take;
+  while ((take = take_range(args)) == TAKE_WAIT) {
+    // Check again later, a range may fall behind by then, setup finishing
+    // wakes us early
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_nsec += HEDGE_POLL_US * 1000L;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec %= 1000000000L;
+    pthread_cond_timedwait(&scheduler.cond, &scheduler.mutex, &ts);
+  }
+
+  pthread_mutex_unlock(&scheduler.mutex);
+  return take == TAKE_FOUND;
+}
+
+/* ===============================================================
+                          BANDWIDTH LIMITS
+=============================================================== */
+// Take len bytes from a bucket, returns how many seconds the caller has to hold
+// off before taking more. The bucket only remembers when everything taken so
+// far is paid for, so any connection that is receiving uses up budget a slow
+// one leaves unused, and no lock is held on the write path
+double bucket_take(DLBucket *bucket, size_t len) {
+  unsigned long long rate = __atomic_load_n(&bucket->rate, __ATOMIC_RELAXED);
+  if (rate == 0) return 0;
+
+  unsigned long long now = get_time() * 1e9;
+  unsigned long long cost = len * 1e9 / rate;
+  unsigned long long due = __atomic_load_n(&bucket->due, __ATOMIC_RELAXED);
+  unsigned long long next;
+  do {
+    // Budget left unused in the past is not saved up
+    next = (due > now ? due : now) + cost;
+  } while (!__atomic_compare_exchange_n(&bucket->due, &due, next, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  double ahead = (next - now) / 1e9 - THROTTLE_BURST;
+  return ahead > 0 ? ahead : 0;
+}
+
+// Set the speed limits of the download and of each connection
+void set_rate_limits(unsigned long long rate, unsigned long long conn_rate) {
+  settings.rate_limit = rate;
+  settings.conn_rate = conn_rate;
+  if (rate || conn_rate) rate_limited = true;
+
+  __atomic_store_n(&bandwidth.rate, rate, __ATOMIC_RELAXED);
+  for (int i = 0; thread_infos != NULL && i < settings.max_threads; i++)
+    __atomic_store_n(&thread_infos[i]->bucket.rate, conn_rate,
+                     __ATOMIC_RELAXED);
+}
+
+// Format a rate the way the progress screen does
+void format_rate(char *buf, size_t size, double rate) {
+  if (rate > 1000000000)
+    snprintf(buf, size, "%.2f GB/s", rate / 1000000000);
+  else if (rate > 1000000)
+    snprintf(buf, size, "%.2f MB/s", rate / 1000000);
+  else if (rate > 1000)
+    snprintf(buf, size, "%.2f KB/s", rate / 1000);
+  else
+    snprintf(buf, size, "%.2f B/s", rate);
+}
+
+/* ===============================================================
+                              MIRRORS
+=============================================================== */
+// Set up the mirrors of the download, the first URL is trusted to be the file,
+// the others are checked against it once its length is known
+void setup_mirrors() {
+  mirror_count = settings.url_count > 1 ? settings.url_count : 1;
+  mirrors = calloc(mirror_count, sizeof(DLMirror));
+
+  // Check error
+  if (mirrors == NULL) {
+    printf("ERROR | Could not allocate mirrors\n");
+    exit(EXIT_FAILURE);
+  }
+
+  mirrors[0].url = settings.url;
+  mirrors[0].state = MIRROR_OK;
+  for (int i = 1; i < mirror_count; i++) {
+    mirrors[i].url = settings.urls[i];
+    mirrors[i].state = MIRROR_UNCHECKED;
+  }
+}
+
+// Pick the mirror of a connection's next transfer, the one with the fewest
+// connections for the speed it has shown, so transfers are spread over mirrors
+// in proportion to their throughput. A mirror not measured yet counts as
+// average, and when every mirror but the first is out the first is used
+int mirror_pick() {
+  pthread_mutex_lock(&mirror_mutex);
+  double total = 0;
+  int measured = 0;
+  for (int i = 0; i < mirror_count; i++) {
+    if (mirrors[i].state != MIRROR_OK || mirrors[i].rate <= 0) continue;
+    total += mirrors[i].rate;
+    measured++;
+  }
+  double average = measured > 0 ? total / measured : 1;
+
+  int best = 0;
+  double best_load = -1;
+  for (int i = 0; i < mirror_count; i++) {
+    if (mirrors[i].state != MIRROR_OK) continue;
+    double rate = mirrors[i].rate > 0 ? mirrors[i].rate : average;
+    double load = (mirrors[i].active + 1) / rate;
+    if (best_load < 0 || load < best_load) {
+      best = i;
+      best_load = load;
+    }
+  }
+
+  mirrors[best].active++;
+  pthread_mutex_unlock(&mirror_mutex);
+  return best;
+}
+
+// Stop using a mirror for a while, never the last one in use. Call with
+// mirror_mutex held
+bool mirror_demote(int index, char *reason) {
+  int usable = 0;
+  for (int i = 0; i < mirror_count; i++)
+    if (mirrors[i].state == MIRROR_OK) usable++;
+  if (usable < 2 || mirrors[index].state != MIRROR_OK) return false;
+
+  mirrors[index].state = MIRROR_DEMOTED;
+  mirrors[index].demoted_at = get_time();
+
+  // Add mirror to log
+  char log[512];
+  snprintf(log, sizeof(log),
+           YELLOW " INFO | Mirror %s %s, moving its ranges to other "
+                  "mirrors.\n" RESET,
+           mirrors[index].url, reason);
+  add_log(log);
+  return true;
+}
+
+// A transfer from the thread's mirror ended, a mirror that keeps failing is
+// demoted
+void mirror_release(DLThreadInfo *thread_info, bool failed) {
+  int index = thread_info->mirror;
+  if (index < 0) return;
+  thread_info->mirror = -1;
+
+  pthread_mutex_lock(&mirror_mutex);
+  mirrors[index].active--;
+  mirrors[index].errors = failed ? mirrors[index].errors + 1 : 0;
+  if (mirrors[index].errors >= MIRROR_ERRORS)
+    mirror_demote(index, "keeps failing");
+  pthread_mutex_unlock(&mirror_mutex);
+}
+
+// The thread's mirror sent a response that cannot be used, demote it so the
+// range goes to another mirror. Another transfer may have demoted it already.
+// Returns false when it is the last mirror in use and has to do
+bool mirror_reject(DLThreadInfo *thread_info, char *reason) {
+  int index = thread_info->mirror;
+  if (index < 0 || mirror_count < 2) return false;
+
+  pthread_mutex_lock(&mirror_mutex);
+  bool out = mirrors[index].state != MIRROR_OK || mirror_demote(index, reason);
+  pthread_mutex_unlock(&mirror_mutex);
+  return out;
+}
+
+// Measure each mirror's rate per connection, demote the ones that fall far
+// behind the fastest and give their ranges back to the queue, and let demoted
+// mirrors try again after a while. Called by the main thread every
+// CONTROL_INTERVAL
+void control_mirrors(double elapsed) {
+  if (mirror_count < 2) return;
+
+  pthread_mutex_lock(&mirror_mutex);
+  double fastest = 0;
+  for (int i = 0; i < mirror_count; i++) {
+    DLMirror *mirror = &mirrors[i];
+    curl_off_t bytes = __atomic_load_n(&mirror->bytes, __ATOMIC_RELAXED);
+    curl_off_t received = bytes - mirror->measured;
+    mirror->measured = bytes;
+    if (mirror->state != MIRROR_OK || mirror->active == 0) continue;
+
+    double rate = received / elapsed / mirror->active;
+    mirror->rate = mirror->samples == 0
+                       ? rate
+                       : mirror->rate * (1 - MIRROR_SMOOTHING) +
+                             rate * MIRROR_SMOOTHING;
+    mirror->samples++;
+    if (mirror->rate > fastest) fastest = mirror->rate;
+  }
+
+  bool demoted[MAX_MIRRORS] = {false};
+  bool any = false;
+  double now = get_time();
+  for (int i = 0; i < mirror_count; i++) {
+    DLMirror *mirror = &mirrors[i];
+    if (mirror->state == MIRROR_OK && mirror->samples >= MIRROR_SAMPLES &&
+        mirror->rate * MIRROR_SLOW < fastest)
+      any |= demoted[i] = mirror_demote(i, "is slow");
+
+    // Give a demoted mirror a fresh start
+    if (mirror->state == MIRROR_DEMOTED &&
+        now - mirror->demoted_at >= MIRROR_PENALTY) {
+      mirror->state = MIRROR_OK;
+      mirror->rate = 0;
+      mirror->samples = 0;
+      mirror->errors = 0;
+    }
+  }
+  pthread_mutex_unlock(&mirror_mutex);
+  if (!any) return;
+
+  // Threads still downloading from a demoted mirror give the rest of their
+  // range back, the next transfer of it goes to another mirror
+  pthread_mutex_lock(&scheduler.mutex);
+  for (int i = 0; i < settings.max_threads; i++) {
+    int index = __atomic_load_n(&thread_infos[i]->mirror, __ATOMIC_RELAXED);
+    if (index >= 0 && demoted[index]) return_range(thread_infos[i]->args);
+  }
+  pthread_cond_broadcast(&scheduler.cond);
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+/* ===============================================================
+                             CHECKSUMS
+=============================================================== */
+// Hash function of a name used in manifests and Metalink files, NULL if it
+// is not supported
+const EVP_MD *hash_lookup(char *name) {
+  if (strcasecmp(name, "sha-256") == 0) return EVP_sha256();
+  if (strcasecmp(name, "sha-1") == 0) return EVP_sha1();
+  if (strcasecmp(name, "md5") == 0) return EVP_md5();
+  return NULL;
+}
+
+// Name of a hash function in manifests
+char *hash_name(const EVP_MD *md) {
+  switch (EVP_MD_get_type(md)) {
+    case NID_sha1:
+      return "sha-1";
+    case NID_md5:
+      return "md5";
+    default:
+      return "sha-256";
+  }
+}
+
+// Write len bytes as hex digits
+void hex_encode(unsigned char *bytes, int len, char *hex) {
+  for (int i = 0; i < len; i++) sprintf(hex + i * 2, "%02x", bytes[i]);
+  hex[len * 2] = '\0';
+}
+
+// Read exactly len bytes of hex digits, returns false for anything else
+bool hex_decode(char *hex, unsigned char *bytes, int len) {
+  if (strspn(hex, "0123456789abcdefABCDEF") != (size_t)len * 2) return false;
+  for (int i = 0; i < len; i++) sscanf(hex + i * 2, "%2hhx", &bytes[i]);
+  return true;
+}
+
+// Combine piece hashes into a Merkle root, each level hashes neighbouring
+// pairs of the one below and an odd one out moves up as it is
+void merkle_root(unsigned char *leaves, unsigned char *root) {
+  int len = EVP_MD_get_size(pieces.md);
+  unsigned long long count = pieces.count;
+  unsigned char *level = malloc(count * len + 1);
+  if (level == NULL || count == 0) {
+    EVP_Digest("", 0, root, NULL, pieces.md, NULL);
+    free(level);
+    return;
+  }
+
+  memcpy(level, leaves, count * len);
+  for (; count > 1; count = (count + 1) / 2) {
+    for (unsigned long long i = 0; i < count / 2; i++)
+      EVP_Digest(level + 2 * i * len, 2 * len, level + i * len, NULL,
+                 pieces.md, NULL);
+    if (count % 2)
+      memmove(level + count / 2 * len, level + (count - 1) * len, len);
+  }
+  memcpy(root, level, len);
+  free(level);
+}
+
+// Set up hashing a file of the given length in pieces of size bytes
+void pieces_setup(const EVP_MD *md, unsigned long long size,
+                  curl_off_t length) {
+  pieces.md = md;
+  pieces.size = size;
+  pieces.count = (length + size - 1) / size;
+  pieces.hashes = calloc(pieces.count + 1, EVP_MD_get_size(md));
+  pieces.good = calloc(pieces.count + 1, 1);
+  pieces.tries = calloc(pieces.count + 1, 1);
+  pieces.ctx = EVP_MD_CTX_new();
+  pieces.saved = EVP_MD_CTX_new();
+
+  // A piece that does not match tells on the mirrors it came from
+  if (mirror_count > 1) pieces.sources = calloc(pieces.count + 1, 1);
+
+  // Check error
+  if (pieces.hashes == NULL || pieces.good == NULL || pieces.tries == NULL ||
+      pieces.ctx == NULL || pieces.saved == NULL ||
+      (mirror_count > 1 && pieces.sources == NULL) ||
+      !EVP_DigestInit_ex(pieces.ctx, md, NULL)) {
+    printf("ERROR | Could not allocate pieces\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Load the piece hashes the file is checked against. A manifest is
+//   MTDOWN MANIFEST 1
+//   length=<bytes> piece=<bytes> hash=<sha-256|sha-1|md5> root=<hex>
+// one per line, then an empty line and the hex hash of every piece, one per
+// line. The root is optional and makes sure no piece hash was lost
+void manifest_load(curl_off_t length) {
+  FILE *file = fopen(settings.manifest, "r");
+
+  // Check error
+  if (file == NULL) {
+    printf("ERROR | Could not open manifest %s\n", settings.manifest);
+    exit(EXIT_FAILURE);
+  }
+
+  char line[4096];
+  char hash[4096] = "";
+  char root[4096] = "";
+  unsigned long long saved_length = 0;
+  unsigned long long size = 0;
+  bool valid = fgets(line, sizeof(line), file) &&
+               strcmp(line, "MTDOWN MANIFEST 1\n") == 0;
+
+  // Read the header up to the empty line before the piece hashes
+  while (valid && fgets(line, sizeof(line), file) && strcmp(line, "\n") != 0) {
+    line[strcspn(line, "\n")] = '\0';
+    if (strncmp(line, "length=", 7) == 0)
+      saved_length = strtoull(line + 7, NULL, 10);
+    else if (strncmp(line, "piece=", 6) == 0)
+      size = strtoull(line + 6, NULL, 10);
+    else if (strncmp(line, "hash=", 5) == 0)
+      snprintf(hash, sizeof(hash), "%s", line + 5);
+    else if (strncmp(line, "root=", 5) == 0)
+      snprintf(root, sizeof(root), "%s", line + 5);
+  }
+
+  // Pieces are whole journal blocks, so one can be dropped and fetched again
+  // on its own
+  const EVP_MD *md = hash_lookup(hash);
+  if (!valid || md == NULL || size == 0 || size % JOURNAL_BLOCK_SIZE != 0) {
+    printf("ERROR | Manifest %s is not valid, pieces must be a multiple of "
+           "%dK\n",
+           settings.manifest, JOURNAL_BLOCK_SIZE / 1024);
+    exit(EXIT_FAILURE);
+  }
+  if (saved_length != (unsigned long long)length) {
+    printf("ERROR | Manifest %s is for a file of %llu bytes, not %lld\n",
+           settings.manifest, saved_length, (long long)length);
+    exit(EXIT_FAILURE);
+  }
+
+  pieces_setup(md, size, length);
+  int len = EVP_MD_get_size(md);
+  pieces.expected = malloc(pieces.count * len + 1);
+  for (unsigned long long i = 0; valid && i < pieces.count; i++) {
+    valid = pieces.expected != NULL && fgets(line, sizeof(line), file);
+    line[strcspn(line, "\n")] = '\0';
+    valid = valid && hex_decode(line, pieces.expected + i * len, len);
+  }
+  fclose(file);
+
+  unsigned char sum[EVP_MAX_MD_SIZE];
+  char hex[EVP_MAX_MD_SIZE * 2 + 1] = "";
+  if (valid && *root) {
+    merkle_root(pieces.expected, sum);
+    hex_encode(sum, len, hex);
+  }
+
+  // Check error
+  if (!valid) {
+    printf("ERROR | Manifest %s is missing piece hashes\n", settings.manifest);
+    exit(EXIT_FAILURE);
+  }
+  if (*root && strcasecmp(root, hex) != 0) {
+    printf("ERROR | Manifest %s does not add up to its root hash\n",
+           settings.manifest);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Save the piece hashes of the downloaded file as a manifest, through a
+// temporary file like the journal
+bool manifest_save(char *root) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", settings.manifest_out);
+
+  FILE *file = fopen(tmp, "w");
+  if (file == NULL) return false;
+
+  int len = EVP_MD_get_size(pieces.md);
+  char hex[EVP_MAX_MD_SIZE * 2 + 1];
+  fprintf(file,
+          "MTDOWN MANIFEST 1\nlength=%lld\npiece=%llu\nhash=%s\nroot=%s\n\n",
+          (long long)content_length, pieces.size, hash_name(pieces.md), root);
+  for (unsigned long long i = 0; i < pieces.count; i++) {
+    hex_encode(pieces.hashes + i * len, len, hex);
+    fprintf(file, "%s\n", hex);
+  }
+
+  bool ok = fclose(file) == 0;
+  if (!ok || rename(tmp, settings.manifest_out) != 0) {
+    unlink(tmp);
+    return false;
+  }
+  return true;
+}
+
+// Set up the hashes asked for, returns false without any
+bool digest_init() {
+  if (settings.checksum_md == NULL && pieces.md == NULL) return false;
+  memset(&digest, 0, sizeof(digest));
+  digest.buffer = malloc(DIGEST_CHUNK);
+  if (settings.checksum_md != NULL) digest.ctx = EVP_MD_CTX_new();
+
+  // Check error
+  if (digest.buffer == NULL ||
+      (settings.checksum_md != NULL &&
+       (digest.ctx == NULL ||
+        !EVP_DigestInit_ex(digest.ctx, settings.checksum_md, NULL)))) {
+    printf("ERROR | Could not set up the checksum\n");
+    exit(EXIT_FAILURE);
+  }
+  return true;
+}
+
+// Hash the bytes that follow what the file checksum covers so far
+void digest_update(char *data, size_t len) {
+  if (digest.ctx != NULL) EVP_DigestUpdate(digest.ctx, data, len);
+  digest.hashed += len;
+}
+
+// Hash the file up to end, reading it back from fd. The bytes were just
+// written, so they come from the page cache rather than the disk
+bool digest_read(int fd, unsigned long long end) {
+  while (digest.hashed < end) {
+    size_t n = end - digest.hashed < DIGEST_CHUNK ? end - digest.hashed
+                                                  : DIGEST_CHUNK;
+    ssize_t r = pread(fd, digest.buffer, n, digest.hashed);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    digest_update(digest.buffer, r);
+  }
+  return true;
+}
+
+// Finish the hash of a piece that has been fed to pieces.ctx and compare it
+// with the manifest, returns whether it is good
+bool piece_check(unsigned long long index) {
+  int len = EVP_MD_get_size(pieces.md);
+  unsigned char *hash = pieces.hashes + index * len;
+  EVP_DigestFinal_ex(pieces.ctx, hash, NULL);
+  EVP_DigestInit_ex(pieces.ctx, pieces.md, NULL);
+
+  if (pieces.expected != NULL &&
+      memcmp(hash, pieces.expected + index * len, len) != 0)
+    return false;
+  pieces.good[index] = 1;
+  __atomic_add_fetch(&pieces.checked, 1, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Take a piece that does not match the manifest out of the journal and queue
+// it to be downloaded again. Threads whose last range covered it must not
+// count it back in, so their ranges start after it from now on. A mirror that
+// sent all of it is demoted, along with what it is sending right now. When
+// several sent a part there is no telling which was wrong, the piece comes
+// again as one range and tells next time
+void piece_redo(unsigned long long index) {
+  unsigned long long start = index * pieces.size;
+  unsigned long long end = start + pieces.size;
+  if (end > (unsigned long long)content_length) end = content_length;
+
+  char log[256];
+  if (++pieces.tries[index] == PIECE_TRIES) {
+    snprintf(log, sizeof(log),
+             RED "ERROR | Piece %llu still does not match the manifest after "
+                 "%d tries, exiting...\n" RESET,
+             index, PIECE_TRIES);
+    add_log(log);
+    pieces.failed = true;
+    return;
+  }
+
+  bool demoted[MAX_MIRRORS] = {false};
+  unsigned char sources = 0;
+  if (pieces.sources != NULL)
+    sources = __atomic_exchange_n(&pieces.sources[index], 0, __ATOMIC_RELAXED);
+  for (int i = 0; i < mirror_count; i++) {
+    if (sources != 1 << i) continue;
+    pthread_mutex_lock(&mirror_mutex);
+    demoted[i] = mirror_demote(i, "sent a piece that does not match");
+    pthread_mutex_unlock(&mirror_mutex);
+  }
+
+  pthread_mutex_lock(&scheduler.mutex);
+  DLRange *returned = realloc(
+      scheduler.returned,
+      (scheduler.returned_count + 1 + settings.max_threads) * sizeof(DLRange));
+  if (returned == NULL || !journal_drop(start, end)) {
+    pthread_mutex_unlock(&scheduler.mutex);
+    pieces.failed = true;
+    return;
+  }
+  scheduler.returned = returned;
+
+  for (int i = 0; i < settings.max_threads; i++) {
+    int mirror = __atomic_load_n(&thread_infos[i]->mirror, __ATOMIC_RELAXED);
+    if (mirror >= 0 && demoted[mirror]) return_range(thread_infos[i]->args);
+  }
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLThreadArgs *args = thread_infos[i]->args;
+    pthread_mutex_lock(&args->lock);
+    if (args->start < end && args->durable > start)
+      args->start = args->durable < end ? args->durable : end;
+    pthread_mutex_unlock(&args->lock);
+  }
+
+  scheduler.returned[scheduler.returned_count].start = start;
+  scheduler.returned[scheduler.returned_count].end = end - 1;
+  scheduler.returned_count++;
+  __atomic_sub_fetch(&journal.resumed_bytes, end - start, __ATOMIC_RELAXED);
+  pieces.redone++;
+  pthread_cond_broadcast(&scheduler.cond);
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  snprintf(log, sizeof(log),
+           YELLOW " INFO | Piece %llu does not match the manifest, downloading "
+                  "it again.\n" RESET,
+           index);
+  add_log(log);
+}
+
+// Read a piece that is in the file whole and check it. The file checksum is
+// fed along when it has come up to the piece, and set back if the piece turns
+// out bad. Returns false if the file could not be read
+bool piece_read(unsigned long long index) {
+  unsigned long long start = index * pieces.size;
+  unsigned long long end = start + pieces.size;
+  if (end > (unsigned long long)content_length) end = content_length;
+
+  bool along = digest.hashed == start;
+  if (along && digest.ctx != NULL)
+    EVP_MD_CTX_copy_ex(pieces.saved, digest.ctx);
+
+  for (unsigned long long offset = start; offset < end;) {
+    size_t n = end - offset < DIGEST_CHUNK ? end - offset : DIGEST_CHUNK;
+    ssize_t r = pread(output_fd, digest.buffer, n, offset);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) return false;
+    EVP_DigestUpdate(pieces.ctx, digest.buffer, r);
+    if (along) digest_update(digest.buffer, r);
+    offset += r;
+  }
+
+  if (piece_check(index)) return true;
+  if (along) {
+    if (digest.ctx != NULL) EVP_MD_CTX_copy_ex(digest.ctx, pieces.saved);
+    digest.hashed = start;
+  }
+  piece_redo(index);
+  return true;
+}
+
+// Whether everything asked for is hashed
+bool digest_done() {
+  return (pieces.md == NULL || pieces.checked == pieces.count) &&
+         (digest.ctx == NULL ||
+          digest.hashed == (unsigned long long)content_length);
+}
+
+// Hasher thread, checks every piece as soon as it is in the file whole, and
+// hashes the file in order as the bytes after what is hashed so far come in
+// and check out, so the checksums are ready right after the last range
+void *digest_worker(void *arg) {
+  while (!digest_done() && !pieces.failed) {
+    pthread_mutex_lock(&digest.mutex);
+    bool stop = digest.stop;
+    unsigned long long wakeups = digest.wakeups;
+    pthread_mutex_unlock(&digest.mutex);
+    if (stop) break;
+
+    journal_collect();
+    bool busy = false;
+
+    // With a file checksum the pieces are taken in order so it can follow
+    // along, otherwise as soon as each is in
+    for (unsigned long long i = 0; pieces.md != NULL && i < pieces.count; i++) {
+      unsigned long long end = (i + 1) * pieces.size;
+      if (end > (unsigned long long)content_length) end = content_length;
+      if (pieces.good[i]) continue;
+      if (journal_contiguous(i * pieces.size) < end) {
+        if (digest.ctx != NULL) break;
+        continue;
+      }
+      if (!piece_read(i)) {
+        digest.failed = true;
+        return NULL;
+      }
+      busy = true;
+    }
+
+    // Only pieces that checked out go into the file checksum
+    unsigned long long ready =
+        digest.ctx != NULL ? journal_contiguous(digest.hashed) : 0;
+    if (pieces.md != NULL) {
+      unsigned long long i = digest.hashed / pieces.size;
+      while (i < pieces.count && pieces.good[i]) i++;
+      if (ready > i * pieces.size) ready = i * pieces.size;
+    }
+    if (ready > digest.hashed) {
+      if (!digest_read(output_fd, ready)) {
+        digest.failed = true;
+        return NULL;
+      }
+      busy = true;
+    }
+
+    // Sleep until a thread has flushed more of the file
+    if (busy) continue;
+    pthread_mutex_lock(&digest.mutex);
+    while (!digest.stop && digest.wakeups == wakeups)
+      pthread_cond_wait(&digest.cond, &digest.mutex);
+    pthread_mutex_unlock(&digest.mutex);
+  }
+  return NULL;
+}
+
+// Tell the hasher that more of the file is durable, there may be pieces to
+// check or bytes to hash now
+void digest_wake() {
+  if (!digest.running) return;
+  pthread_mutex_lock(&digest.mutex);
+  digest.wakeups++;
+  pthread_cond_signal(&digest.cond);
+  pthread_mutex_unlock(&digest.mutex);
+}
+
+// Hash bytes on their way out of a stream. A piece that does not match the
+// manifest cannot be fetched again once the bytes before it are out, the
+// stream stops short of its end instead. Returns false then
+bool digest_out(char *data, size_t len, unsigned long long offset) {
+  digest_update(data, len);
+  if (pieces.md == NULL) return true;
+
+  EVP_DigestUpdate(pieces.ctx, data, len);
+  unsigned long long index = offset / pieces.size;
+  unsigned long long end = (index + 1) * pieces.size;
+  if (end > (unsigned long long)content_length) end = content_length;
+  if (offset + len < end || piece_check(index)) return true;
+
+  char log[256];
+  snprintf(log, sizeof(log),
+           RED "ERROR | Piece %llu does not match the manifest, exiting...\n"
+               RESET,
+           index);
+  add_log(log);
+  return false;
+}
+
+// Start hashing the file of a split download. A stream is hashed by its
+// flusher on the way out, any other file by a hasher thread reading back what
+// is in the file
+void digest_start() {
+  if (!digest_init() || settings.io_mode == IO_STREAM) return;
+  pthread_mutex_init(&digest.mutex, NULL);
+  pthread_cond_init(&digest.cond, NULL);
+  pthread_create(&digest.thread, NULL, digest_worker, NULL);
+  digest.running = true;
+}
+
+// Stop hashing, and for a complete file compare its checksum with the one
+// given, work out the Merkle root of its pieces, save the manifest and print
+// the results. Returns whether the file checks out
+bool digest_finish(bool complete) {
+  if (digest.buffer == NULL) return complete;
+  if (digest.running) {
+    pthread_mutex_lock(&digest.mutex);
+    digest.stop = !complete;
+    pthread_cond_signal(&digest.cond);
+    pthread_mutex_unlock(&digest.mutex);
+    pthread_join(digest.thread, NULL);
+    pthread_mutex_destroy(&digest.mutex);
+    pthread_cond_destroy(&digest.cond);
+  }
+
+  char line[256];
+  char hex[EVP_MAX_MD_SIZE * 2 + 1] = "";
+  unsigned char md[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+  bool matched = complete;
+  if (complete && digest.ctx != NULL) {
+    matched = !digest.failed && EVP_DigestFinal_ex(digest.ctx, md, &len);
+    hex_encode(md, len, hex);
+    matched = matched && strcasecmp(hex, settings.checksum) == 0;
+
+    snprintf(line, sizeof(line), "%s %s ",
+             EVP_MD_get0_name(settings.checksum_md),
+             matched ? "verified" : "mismatch");
+    printf("\n%s" BOLD, matched ? GREEN : RED);
+    print_center(line);
+    printf("%s\n" RESET, matched ? CHECKMARK : CROSSMARK);
+    if (!matched) {
+      snprintf(line, sizeof(line), "expected %s", settings.checksum);
+      print_center(line);
+      printf("\n");
+      snprintf(line, sizeof(line), "got      %s",
+               digest.failed ? "nothing, the file could not be read" : hex);
+      print_center(line);
+      printf("\n");
+    }
+  }
+
+  // Every piece is hashed by now unless the file could not be read back
+  if (complete && pieces.md != NULL) {
+    bool checked = pieces.checked == pieces.count;
+    if (pieces.expected != NULL || !checked) {
+      snprintf(line, sizeof(line),
+               "%llu of %llu pieces verified, %d fetched again ",
+               pieces.checked, pieces.count, pieces.redone);
+      printf("\n%s" BOLD, checked ? GREEN : RED);
+      print_center(line);
+      printf("%s\n" RESET, checked ? CHECKMARK : CROSSMARK);
+    }
+    matched = matched && checked;
+
+    if (checked) {
+      merkle_root(pieces.hashes, md);
+      hex_encode(md, EVP_MD_get_size(pieces.md), hex);
+      snprintf(line, sizeof(line), "Merkle root %s", hex);
+      print_center(line);
+      printf("\n");
+    }
+    if (checked && settings.manifest_out != NULL) {
+      snprintf(line, sizeof(line),
+               manifest_save(hex) ? "Manifest saved to %s"
+                                  : RED "Could not save manifest %s" RESET,
+               settings.manifest_out);
+      print_center(line);
+      printf("\n");
+    }
+  }
+
+  if (digest.ctx != NULL) EVP_MD_CTX_free(digest.ctx);
+  free(digest.buffer);
+  digest.ctx = NULL;
+  digest.buffer = NULL;
+  digest.running = false;
+  digest.mismatch = complete && !matched;
+
+  EVP_MD_CTX_free(pieces.ctx);
+  EVP_MD_CTX_free(pieces.saved);
+  free(pieces.expected);
+  free(pieces.hashes);
+  free(pieces.good);
+  free(pieces.tries);
+  free(pieces.sources);
+  memset(&pieces, 0, sizeof(pieces));
+  return matched;
+}
+
+/* ===============================================================
+                             METALINK
+=============================================================== */
+// Find the next tag at or after p, skipping comments and declarations. Writes
+// its name without a namespace prefix, with a leading / for a closing tag,
+// points attrs at what follows the name and returns the first byte after the
+// tag, NULL when there are no more
+char *xml_next(char *p, char *name, size_t size, char **attrs) {
+  while ((p = strchr(p, '<')) != NULL) {
+    if (strncmp(p, "<!--", 4) == 0) {
+      p = strstr(p, "-->");
+      if (p == NULL) return NULL;
+      continue;
+    }
+    char *end = strchr(p, '>');
+    if (end == NULL) return NULL;
+    if (p[1] == '?' || p[1] == '!') {
+      p = end + 1;
+      continue;
+    }
+
+    char *start = p + 1 + (p[1] == '/');
+    size_t len = strcspn(start, " \t\r\n/>");
+    char *colon = memchr(start, ':', len);
+    if (colon != NULL) {
+      len -= colon + 1 - start;
+      start = colon + 1;
+    }
+    snprintf(name, size, "%s%.*s", p[1] == '/' ? "/" : "", (int)len, start);
+    *attrs = start + len;
+    return end + 1;
+  }
+  return NULL;
+}
+
+// Copy text up to the next tag, trimmed and with the predefined entities
+// decoded
+void xml_text(char *p, char *buf, size_t size) {
+  size_t len = 0;
+  while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+  while (*p && *p != '<' && len + 1 < size) {
+    char c = *p++;
+    if (c == '&') {
+      char *entities[] = {"amp;", "lt;", "gt;", "quot;", "apos;"};
+      char chars[] = {'&', '<', '>', '"', '\''};
+      for (int i = 0; i < 5; i++) {
+        if (strncmp(p, entities[i], strlen(entities[i])) != 0) continue;
+        c = chars[i];
+        p += strlen(entities[i]);
+        break;
+      }
+    }
+    buf[len++] = c;
+  }
+  while (len > 0 && (buf[len - 1] == ' ' || buf[len - 1] == '\t' ||
+                     buf[len - 1] == '\r' || buf[len - 1] == '\n'))
+    len--;
+  buf[len] = '\0';
+}
+
+// Read an attribute of a tag, attrs as returned by xml_next, returns false if
+// the tag does not have it
+bool xml_attr(char *attrs, char *key, char *buf, size_t size) {
+  char *end = strchr(attrs, '>');
+  size_t len = strlen(key);
+  for (char *p = attrs; p != NULL && p < end; p = strstr(p + 1, key)) {
+    if ((p[-1] != ' ' && p[-1] != '\t' && p[-1] != '\r' && p[-1] != '\n') ||
+        strncmp(p, key, len) != 0 || p[len] != '=' ||
+        (p[len + 1] != '"' && p[len + 1] != '\''))
+      continue;
+    char *value = p + len + 2;
+    char *close = strchr(value, p[len + 1]);
+    if (close == NULL || close > end) return false;
+    snprintf(buf, size, "%.*s", (int)(close - value), value);
+    return true;
+  }
+  return false;
+}
+
+// Order URLs by priority, lower first
+int metalink_compare(const void *a, const void *b) {
+  return ((DLMetalinkURL *)a)->priority - ((DLMetalinkURL *)b)->priority;
+}
+
+// Read the first file of a Metalink (RFC 5854): its name, size, whole file
+// hash, piece hashes and the URLs it can be downloaded from. The URLs become
+// the mirrors of the download, most preferred first, and the name the default
+// output
+void metalink_load() {
+  FILE *file = fopen(settings.metalink, "r");
+  char *xml = NULL;
+  size_t size = 0;
+  bool read = file != NULL && getdelim(&xml, &size, '\0', file) > 0;
+  if (file != NULL) fclose(file);
+
+  // Check error
+  if (!read) {
+    fprintf(stderr, "Error: could not read Metalink %s\n", settings.metalink);
+    exit(EXIT_FAILURE);
+  }
+
+  metalink.size = -1;
+  int strength = 0;
+  int files = 0;
+  bool in_file = false;
+  bool in_pieces = false;
+  char name[64];
+  char text[8192];
+  char value[PATH_MAX];
+  char *attrs;
+  int len = 0;
+  for (char *p = xml; (p = xml_next(p, name, sizeof(name), &attrs)) != NULL;) {
+    if (strcmp(name, "file") == 0) {
+      in_file = ++files == 1;
+      if (in_file && xml_attr(attrs, "name", value, sizeof(value)))
+        metalink.name = strdup(value);
+    } else if (strcmp(name, "/file") == 0) {
+      in_file = false;
+    } else if (!in_file) {
+      continue;
+    } else if (strcmp(name, "size") == 0) {
+      xml_text(p, text, sizeof(text));
+      metalink.size = strtoll(text, NULL, 10);
+    } else if (strcmp(name, "pieces") == 0) {
+      // Pieces of a hash function we do not have are simply not checked
+      in_pieces = xml_attr(attrs, "type", value, sizeof(value)) &&
+                  hash_lookup(value) != NULL;
+      if (in_pieces) {
+        metalink.piece_md = hash_lookup(value);
+        len = EVP_MD_get_size(metalink.piece_md);
+        if (xml_attr(attrs, "length", value, sizeof(value)))
+          metalink.piece_size = strtoull(value, NULL, 10);
+      }
+    } else if (strcmp(name, "/pieces") == 0) {
+      in_pieces = false;
+    } else if (strcmp(name, "hash") == 0 && in_pieces) {
+      unsigned char *hashes = realloc(metalink.piece_hashes,
+                                      (metalink.piece_count + 1) * len);
+      xml_text(p, text, sizeof(text));
+      if (hashes == NULL ||
+          !hex_decode(text, hashes + metalink.piece_count * len, len)) {
+        fprintf(stderr, "Error: Metalink %s has a bad piece hash\n",
+                settings.metalink);
+        exit(EXIT_FAILURE);
+      }
+      metalink.piece_hashes = hashes;
+      metalink.piece_count++;
+    } else if (strcmp(name, "hash") == 0) {
+      // Keep the strongest whole file hash we can check
+      xml_attr(attrs, "type", value, sizeof(value));
+      const EVP_MD *md = hash_lookup(value);
+      int rank = md == NULL                               ? 0
+                 : strcasecmp(value, "sha-256") == 0 ? 3
+                 : strcasecmp(value, "sha-1") == 0   ? 2
+                                                     : 1;
+      xml_text(p, text, sizeof(text));
+      if (rank > strength &&
+          strlen(text) == (size_t)EVP_MD_get_size(md) * 2 &&
+          strspn(text, "0123456789abcdefABCDEF") == strlen(text)) {
+        strength = rank;
+        metalink.hash_md = md;
+        memcpy(metalink.hash, text, strlen(text) + 1);
+      }
+    } else if (strcmp(name, "url") == 0) {
+      // Only what curl can fetch by range the way the workers ask for it
+      xml_text(p, text, sizeof(text));
+      if (strncasecmp(text, "http://", 7) != 0 &&
+          strncasecmp(text, "https://", 8) != 0)
+        continue;
+      DLMetalinkURL *urls = realloc(
+          metalink.urls, (metalink.url_count + 1) * sizeof(DLMetalinkURL));
+      if (urls == NULL) continue;
+      metalink.urls = urls;
+      DLMetalinkURL *url = &urls[metalink.url_count++];
+      url->url = strdup(text);
+      url->priority = xml_attr(attrs, "priority", value, sizeof(value))
+                          ? atoi(value)
+                          : METALINK_NO_PRIORITY;
+      url->location[0] = '\0';
+      if (xml_attr(attrs, "location", value, sizeof(value)))
+        snprintf(url->location, sizeof(url->location), "%.*s",
+                 (int)sizeof(url->location) - 1, value);
+    }
+  }
+  free(xml);
+
+  // Check error
+  if (files == 0 || metalink.url_count == 0) {
+    fprintf(stderr, "Error: Metalink %s has no file with an HTTP URL\n",
+            settings.metalink);
+    exit(EXIT_FAILURE);
+  }
+  if (files > 1)
+    fprintf(stderr, "Metalink %s lists %d files, downloading the first\n",
+            settings.metalink, files);
+
+  // The most preferred URLs are the mirrors, the first of them is trusted
+  // most. Sorting keeps the order of the file among equals
+  for (int i = 0; i < metalink.url_count; i++)
+    metalink.urls[i].priority = metalink.urls[i].priority * 1024 + i;
+  qsort(metalink.urls, metalink.url_count, sizeof(DLMetalinkURL),
+        metalink_compare);
+  for (int i = 0; i < metalink.url_count; i++)
+    metalink.urls[i].priority /= 1024;
+  settings.url_count =
+      metalink.url_count < MAX_MIRRORS ? metalink.url_count : MAX_MIRRORS;
+  for (int i = 0; i < settings.url_count; i++)
+    settings.urls[i] = metalink.urls[i].url;
+  settings.url = settings.urls[0];
+
+  // Save under the name the Metalink gives, never outside the current
+  // directory
+  if (settings.filename == NULL && metalink.name != NULL) {
+    char *base = strrchr(metalink.name, '/');
+    base = base != NULL ? base + 1 : metalink.name;
+    if (*base && strcmp(base, ".") != 0 && strcmp(base, "..") != 0)
+      settings.filename = base;
+  }
+
+  // A checksum given on the command line wins
+  if (settings.checksum_md == NULL && metalink.hash_md != NULL) {
+    settings.checksum_md = metalink.hash_md;
+    settings.checksum = metalink.hash;
+  }
+}
+
+// Check the file against the Metalink's piece hashes, if it has usable ones.
+// Returns false when it does not
+bool metalink_pieces(curl_off_t length) {
+  if (settings.metalink == NULL || metalink.piece_md == NULL) return false;
+
+  // Pieces are whole journal blocks, so one can be dropped and fetched again
+  // on its own
+  unsigned long long size = metalink.piece_size;
+  if (size == 0 || size % JOURNAL_BLOCK_SIZE != 0 ||
+      metalink.piece_count != (length + size - 1) / size) {
+    char log[256];
+    snprintf(log, sizeof(log),
+             YELLOW " INFO | Metalink pieces are not whole %dK blocks of the "
+                    "file, they are not checked.\n" RESET,
+             JOURNAL_BLOCK_SIZE / 1024);
+    add_log(log);
+    return false;
+  }
+
+  pieces_setup(metalink.piece_md, size, length);
+  pieces.expected = metalink.piece_hashes;
+  metalink.piece_hashes = NULL;
+  return true;
+}
+
+/* ===============================================================
+                           DISK WRITERS
+=============================================================== */
+// Write a whole buffer at a file offset, pwrite does not move a shared file
+// position so threads never have to seek
+bool write_at(char *ptr, size_t len, unsigned long long offset) {
+  while (len > 0) {
+    ssize_t written = pwrite(output_fd, ptr, len, offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    ptr += written;
+    len -= written;
+    offset += written;
+  }
+  return true;
+}
+
+// Thin wrappers for the io_uring syscalls, glibc does not provide them
+int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                 NULL, 0);
+}
+int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Free a ring and everything it mapped
+void ring_destroy(DLRing *ring) {
+  if (ring == NULL) return;
+  if (ring->sqes) munmap(ring->sqes, URING_BUFFERS * sizeof(*ring->sqes));
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+  if (ring->memory) free(ring->memory);
+  if (ring->buffers) free(ring->buffers);
+  if (ring->free) free(ring->free);
+  free(ring);
+}
+
+// Create an io_uring with registered buffers and the output file registered,
+// returns NULL when the kernel does not support it
+DLRing *ring_create() {
+  DLRing *ring = calloc(1, sizeof(DLRing));
+  if (ring == NULL) return NULL;
+  ring->fill = -1;
+
+  // One submission entry per buffer, so there is always room to queue a write
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  ring->fd = uring_setup(URING_BUFFERS, &params);
+  if (ring->fd < 0) {
+    free(ring);
+    return NULL;
+  }
+
+  // Map the rings, which share one mapping on newer kernels
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    ring_destroy(ring);
+    return NULL;
+  }
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring =
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      ring_destroy(ring);
+      return NULL;
+    }
+  }
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  char *sq = ring->sq_ring;
+  char *cq = ring->cq_ring;
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  // Allocate and register the buffers so the kernel does not have to map
+  // them on every write
+  ring->memory = aligned_alloc(4096, URING_BUFFERS * URING_BUFFER_SIZE);
+  ring->buffers = calloc(URING_BUFFERS, sizeof(DLRingBuffer));
+  ring->free = malloc(URING_BUFFERS * sizeof(int));
+  if (ring->memory == NULL || ring->buffers == NULL || ring->free == NULL) {
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  struct iovec iovecs[URING_BUFFERS];
+  for (int i = 0; i < URING_BUFFERS; i++) {
+    iovecs[i].iov_base = ring->memory + i * URING_BUFFER_SIZE;
+    iovecs[i].iov_len = URING_BUFFER_SIZE;
+    ring->free[i] = i;
+  }
+  ring->free_count = URING_BUFFERS;
+
+  if (uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs,
+                     URING_BUFFERS) < 0 ||
+      uring_register(ring->fd, IORING_REGISTER_FILES, &output_fd, 1) < 0) {
+    ring_destroy(ring);
+    return NULL;
+  }
+
+  return ring;
+}
+
+// Queue a write of the rest of a buffer, submitted later in a batch
+void ring_queue(DLRing *ring, int index) {
+  DLRingBuffer *buffer = &ring->buffers[index];
+  unsigned tail = *ring->sq_tail;
+  unsigned slot = tail & *ring->sq_mask;
+
+  struct io_uring_sqe *sqe = &ring->sqes[slot];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITE_FIXED;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->fd = 0;  // index of output_fd in the registered files
+  sqe->addr = (unsigned long)(ring->memory + index * URING_BUFFER_SIZE +
+                              buffer->done);
+  sqe->len = buffer->len - buffer->done;
+  sqe->off = buffer->offset + buffer->done;
+  sqe->buf_index = index;
+  sqe->user_data = index;
+
+  ring->sq_array[slot] = slot;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+}
+
+// Recycle buffers whose writes have completed, resubmitting short writes
+void ring_reap(DLRing *ring) {
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    int index = cqe->user_data;
+    DLRingBuffer *buffer = &ring->buffers[index];
+
+    if (cqe->res < 0 || (cqe->res == 0 && buffer->len > buffer->done)) {
+      // Keep the first error, the thread reports it when it flushes
+      if (ring->error == 0) ring->error = cqe->res < 0 ? -cqe->res : EIO;
+      ring->free[ring->free_count++] = index;
+      ring->inflight--;
+    } else if (buffer->done + cqe->res < buffer->len) {
+      buffer->done += cqe->res;
+      ring_queue(ring, index);
+    } else {
+      ring->free[ring->free_count++] = index;
+      ring->inflight--;
+    }
+    head++;
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Submit queued writes, optionally waiting for at least one to complete
+void ring_submit(DLRing *ring, bool wait) {
+  unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+  while (true) {
+    int submitted = uring_enter(ring->fd, ring->queued, wait ? 1 : 0, flags);
+    if (submitted < 0 && errno == EINTR) continue;
+    if (submitted < 0) {
+      if (ring->error == 0) ring->error = errno;
+      return;
+    }
+    ring->queued -= submitted;
+    if (ring->queued == 0) break;
+  }
+}
+
+// Hand the buffer being filled to the kernel
+void ring_seal(DLRing *ring) {
+  if (ring->fill < 0) return;
+  ring_queue(ring, ring->fill);
+  ring->inflight++;
+  ring->fill = -1;
+  if (ring->queued >= URING_BATCH) ring_submit(ring, false);
+}
+
+// Copy received data into registered buffers, the thread only waits on the
+// disk when every buffer is still being written
+bool ring_write(DLRing *ring, char *ptr, size_t len,
+                unsigned long long offset) {
+  while (len > 0) {
+    // Start a new buffer when the data does not continue the current one
+    if (ring->fill >= 0) {
+      DLRingBuffer *fill = &ring->buffers[ring->fill];
+      if (fill->offset + fill->len != offset || fill->len == URING_BUFFER_SIZE)
+        ring_seal(ring);
+    }
+
+    if (ring->fill < 0) {
+      ring_reap(ring);
+      while (ring->free_count == 0) {
+        ring_submit(ring, true);
+        ring_reap(ring);
+      }
+      ring->fill = ring->free[--ring->free_count];
+      ring->buffers[ring->fill].offset = offset;
+      ring->buffers[ring->fill].len = 0;
+      ring->buffers[ring->fill].done = 0;
+    }
+
+    DLRingBuffer *fill = &ring->buffers[ring->fill];
+    size_t n = URING_BUFFER_SIZE - fill->len;
+    if (n > len) n = len;
+    memcpy(ring->memory + ring->fill * URING_BUFFER_SIZE + fill->len, ptr, n);
+    fill->len += n;
+    ptr += n;
+    len -= n;
+    offset += n;
+  }
+
+  if (ring->error) errno = ring->error;
+  return ring->error == 0;
+}
+
+// Write out everything still buffered and wait for it, returns false and sets
+// errno if any write failed since the last flush
+bool ring_flush(DLRing *ring) {
+  ring_seal(ring);
+  while (ring->inflight > 0) {
+    ring_submit(ring, true);
+    ring_reap(ring);
+  }
+
+  int error = ring->error;
+  ring->error = 0;
+  if (error) errno = error;
+  return error == 0;
+}
+
+// Write a run of adjacent slots with as few syscalls as possible
+void writer_flush_run(DLWriteSlot **run, int count) {
+  struct iovec iov[WRITER_BATCH];
+  size_t total = 0;
+  for (int i = 0; i < count; i++) {
+    iov[i].iov_base = run[i]->data;
+    iov[i].iov_len = run[i]->len;
+    total += run[i]->len;
+  }
+
+  // Write the run in one go, finishing a short write piece by piece
+  int error = 0;
+  ssize_t written = 0;
+  if (total > 0) {
+    do {
+      written = pwritev(output_fd, iov, count, run[0]->offset);
+    } while (written < 0 && errno == EINTR);
+    if (written < 0) error = errno;
+  }
+
+  size_t done = written > 0 ? written : 0;
+  for (int i = 0; i < count && error == 0 && done < total; i++) {
+    if (done >= run[i]->len) {
+      done -= run[i]->len;
+      continue;
+    }
+    if (!write_at(run[i]->data + done, run[i]->len - done,
+                  run[i]->offset + done))
+      error = errno;
+    done = 0;
+  }
+
+  // Report back to the threads that queued the data
+  for (int i = 0; i < count; i++) {
+    if (error)
+      __atomic_compare_exchange_n(&run[i]->owner->write_error, &(int){0},
+                                  error, false, __ATOMIC_RELAXED,
+                                  __ATOMIC_RELAXED);
+    __atomic_add_fetch(&run[i]->owner->written, 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Drain the queue, merging slots that continue each other into one write
+void *writer_worker(void *arg) {
+  DLWriter *writer = (DLWriter *)arg;
+  DLWriteSlot *batch[WRITER_BATCH];
+
+  while (true) {
+    // Take every slot that is ready, in queue order
+    int count = 0;
+    while (count < WRITER_BATCH) {
+      DLWriteSlot *slot =
+          &writer->slots[(writer->dequeue_pos + count) % WRITER_SLOTS];
+      if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+          writer->dequeue_pos + count + 1)
+        break;
+      batch[count++] = slot;
+    }
+
+    if (count == 0) {
+      if (__atomic_load_n(&writer->stop, __ATOMIC_ACQUIRE)) break;
+
+      // Sleep until a thread queues data, the timeout covers a missed wakeup
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_nsec += WRITER_IDLE_MS * 1000000L;
+      if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+      }
+      pthread_mutex_lock(&writer->mutex);
+      __atomic_store_n(&writer->sleeping, 1, __ATOMIC_SEQ_CST);
+      pthread_cond_timedwait(&writer->cond, &writer->mutex, &until);
+      __atomic_store_n(&writer->sleeping, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&writer->mutex);
+      continue;
+    }
+
+    // Write runs of adjacent slots, skipping empty ones
+    int start = 0;
+    while (start < count) {
+      if (batch[start]->len == 0) {
+        writer_flush_run(&batch[start], 1);
+        start++;
+        continue;
+      }
+      int end = start + 1;
+      while (end < count && batch[end]->len > 0 &&
+             batch[end]->offset ==
+                 batch[end - 1]->offset + batch[end - 1]->len)
+        end++;
+      writer_flush_run(&batch[start], end - start);
+      start = end;
+    }
+
+    // Hand the slots back to the producers
+    for (int i = 0; i < count; i++)
+      __atomic_store_n(&batch[i]->seq, writer->dequeue_pos + i + WRITER_SLOTS,
+                       __ATOMIC_RELEASE);
+    writer->dequeue_pos += count;
+  }
+
+  return NULL;
+}
+
+// Start the writer threads and their queues
+void start_writers() {
+  writers = calloc(settings.writers, sizeof(DLWriter));
+
+  // Check error
+  if (writers == NULL) {
+    printf("ERROR | Could not allocate writers\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < settings.writers; i++) {
+    writers[i].slots = calloc(WRITER_SLOTS, sizeof(DLWriteSlot));
+    writers[i].memory = malloc((size_t)WRITER_SLOTS * WRITER_SLOT_SIZE);
+
+    // Check error
+    if (writers[i].slots == NULL || writers[i].memory == NULL) {
+      printf("ERROR | Could not allocate queue for writer %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    for (int j = 0; j < WRITER_SLOTS; j++) {
+      writers[i].slots[j].seq = j;
+      writers[i].slots[j].data = writers[i].memory + j * WRITER_SLOT_SIZE;
+    }
+
+    pthread_mutex_init(&writers[i].mutex, NULL);
+    pthread_cond_init(&writers[i].cond, NULL);
+    pthread_create(&writers[i].thread, NULL, writer_worker, &writers[i]);
+  }
+}
+
+// Let the writer threads drain their queues and exit
+void stop_writers() {
+  if (writers == NULL) return;
+
+  for (int i = 0; i < settings.writers; i++) {
+    __atomic_store_n(&writers[i].stop, true, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&writers[i].mutex);
+    pthread_cond_signal(&writers[i].cond);
+    pthread_mutex_unlock(&writers[i].mutex);
+    pthread_join(writers[i].thread, NULL);
+    pthread_mutex_destroy(&writers[i].mutex);
+    pthread_cond_destroy(&writers[i].cond);
+    free(writers[i].slots);
+    free(writers[i].memory);
+  }
+  free(writers);
+  writers = NULL;
+}
+
+// Claim a queue slot for the next chunk before any of it is taken from curl,
+// returns false when the queue is full so the transfer can be paused
+bool writer_reserve(DLThreadInfo *thread_info, size_t len) {
+  // Chunks bigger than a slot are rare and written directly
+  if (len > WRITER_SLOT_SIZE) return true;
+
+  DLWriter *writer = thread_info->writer;
+  unsigned long pos = __atomic_load_n(&writer->enqueue_pos, __ATOMIC_RELAXED);
+  while (true) {
+    DLWriteSlot *slot = &writer->slots[pos % WRITER_SLOTS];
+    unsigned long seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    long diff = (long)seq - (long)pos;
+
+    if (diff == 0) {
+      // Slot is free, race the other producers for it
+      if (__atomic_compare_exchange_n(&writer->enqueue_pos, &pos, pos + 1,
+                                      true, __ATOMIC_RELAXED,
+                                      __ATOMIC_RELAXED)) {
+        thread_info->slot = slot;
+        return true;
+      }
+    } else if (diff < 0) {
+      // The writer has not freed this slot yet, the queue is full
+      return false;
+    } else {
+      pos = __atomic_load_n(&writer->enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+// Whether the thread's writer queue has room again, used to resume a paused
+// transfer
+bool writer_has_room(DLThreadInfo *thread_info) {
+  DLWriter *writer = thread_info->writer;
+  unsigned long pos = __atomic_load_n(&writer->enqueue_pos, __ATOMIC_RELAXED);
+  DLWriteSlot *slot = &writer->slots[pos % WRITER_SLOTS];
+  return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == pos;
+}
+
+// Copy the chunk into the reserved slot and publish it to the writer
+bool writer_write(DLThreadInfo *thread_info, char *ptr, size_t len,
+                  unsigned long long offset) {
+  DLWriteSlot *slot = thread_info->slot;
+  if (slot == NULL) return write_at(ptr, len, offset);
+  thread_info->slot = NULL;
+
+  memcpy(slot->data, ptr, len);
+  slot->owner = thread_info;
+  slot->offset = offset;
+  slot->len = len;
+  thread_info->queued++;
+  __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+
+  // Wake the writer if it went to sleep on an empty queue
+  DLWriter *writer = thread_info->writer;
+  if (__atomic_load_n(&writer->sleeping, __ATOMIC_SEQ_CST)) {
+    pthread_mutex_lock(&writer->mutex);
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->mutex);
+  }
+
+  int error = __atomic_load_n(&thread_info->write_error, __ATOMIC_RELAXED);
+  if (error) errno = error;
+  return error == 0;
+}
+
+// Wait until the writer has written everything this thread queued
+bool writer_flush(DLThreadInfo *thread_info) {
+  while (__atomic_load_n(&thread_info->written, __ATOMIC_ACQUIRE) !=
+         thread_info->queued)
+    usleep(1000);
+
+  int error = __atomic_exchange_n(&thread_info->write_error, 0,
+                                  __ATOMIC_RELAXED);
+  if (error) errno = error;
+  return error == 0;
+}
+
+// Map the preallocated file once so threads can copy into it without any
+// write syscalls, returns false if the file cannot be mapped
+bool map_output(curl_off_t length) {
+  void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, output_fd,
+                   0);
+  if (map == MAP_FAILED) return false;
+
+  // Threads mostly move forward through their ranges
+  madvise(map, length, MADV_SEQUENTIAL);
+  output_map = map;
+  return true;
+}
+
+// Start writeback of the part of the mapping the thread just filled, so dirty
+// pages are paced per range instead of piling up until munmap
+bool map_flush(DLThreadInfo *thread_info) {
+  DLThreadArgs *args = thread_info->args;
+  pthread_mutex_lock(&args->lock);
+  unsigned long long from = args->start;
+  unsigned long long to = args->pos;
+  pthread_mutex_unlock(&args->lock);
+
+  if (to > from)
+    sync_file_range(output_fd, from, to - from, SYNC_FILE_RANGE_WRITE);
+  return true;
+}
+
+// Open the file a second time with O_DIRECT and set up the buffer pool,
+// returns false when the filesystem does not support O_DIRECT
+bool open_direct() {
+  direct_fd = open(settings.filename, O_WRONLY | O_DIRECT);
+  if (direct_fd < 0) return false;
+
+  // Align to the filesystem block size, which covers what O_DIRECT needs
+  struct stat st;
+  if (fstat(direct_fd, &st) != 0 || st.st_blksize <= 0 ||
+      DIRECT_BUFFER_SIZE % st.st_blksize != 0 ||
+      JOURNAL_BLOCK_SIZE % st.st_blksize != 0) {
+    close(direct_fd);
+    direct_fd = -1;
+    return false;
+  }
+  direct_align = st.st_blksize;
+
+  // Preallocate every buffer up front so memory stays bounded, with at least
+  // one per connection since each holds on to its buffer until it is full
+  int count = settings.direct_pool / DIRECT_BUFFER_SIZE;
+  if (count < settings.max_threads) count = settings.max_threads;
+  direct_pool.memory = aligned_alloc(direct_align,
+                                     (size_t)count * DIRECT_BUFFER_SIZE);
+  direct_pool.free = malloc(count * sizeof(char *));
+
+  // Check error
+  if (direct_pool.memory == NULL || direct_pool.free == NULL) {
+    printf("ERROR | Could not allocate O_DIRECT buffers\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < count; i++)
+    direct_pool.free[i] = direct_pool.memory + (size_t)i * DIRECT_BUFFER_SIZE;
+  direct_pool.free_count = count;
+  pthread_mutex_init(&direct_pool.mutex, NULL);
+  pthread_cond_init(&direct_pool.cond, NULL);
+  return true;
+}
+
+// Take a buffer from the pool, waiting for one if they are all in use
+char *pool_get() {
+  pthread_mutex_lock(&direct_pool.mutex);
+  while (direct_pool.free_count == 0)
+    pthread_cond_wait(&direct_pool.cond, &direct_pool.mutex);
+  char *buffer = direct_pool.free[--direct_pool.free_count];
+  pthread_mutex_unlock(&direct_pool.mutex);
+  return buffer;
+}
+
+// Give a buffer back to the pool
+void pool_put(char *buffer) {
+  pthread_mutex_lock(&direct_pool.mutex);
+  direct_pool.free[direct_pool.free_count++] = buffer;
+  pthread_cond_signal(&direct_pool.cond);
+  pthread_mutex_unlock(&direct_pool.mutex);
+}
+
+// Write the whole blocks of the thread's buffer with O_DIRECT and the partial
+// block at the end through the page cache, then return the buffer
+bool direct_flush(DLThreadInfo *thread_info) {
+  if (thread_info->direct_buffer == NULL) return true;
+
+  char *buffer = thread_info->direct_buffer;
+  unsigned long long offset = thread_info->direct_offset;
+  size_t len = thread_info->direct_len;
+  size_t blocks = len - len % direct_align;
+  bool ok = true;
+
+  while (ok && blocks > 0) {
+    ssize_t written = pwrite(direct_fd, buffer, blocks, offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0 || written % direct_align != 0) {
+      if (written >= 0) errno = EIO;
+      ok = false;
+      break;
+    }
+    buffer += written;
+    offset += written;
+    len -= written;
+    blocks -= written;
+  }
+  if (ok && len > 0) ok = write_at(buffer, len, offset);
+
+  pool_put(thread_info->direct_buffer);
+  thread_info->direct_buffer = NULL;
+  thread_info->direct_len = 0;
+  return ok;
+}
+
+// Gather received data into block aligned pool buffers and write them once
+// full, data that does not start on a block boundary goes through the page
+// cache until it reaches one
+bool direct_write(DLThreadInfo *thread_info, char *ptr, size_t len,
+                  unsigned long long offset) {
+  while (len > 0) {
+    // Write out what is buffered when the data does not continue it
+    if (thread_info->direct_buffer != NULL &&
+        thread_info->direct_offset + thread_info->direct_len != offset) {
+      if (!direct_flush(thread_info)) return false;
+    }
+
+    if (thread_info->direct_buffer == NULL) {
+      // Only a block boundary can start a buffer
+      size_t misaligned = offset % direct_align;
+      if (misaligned != 0) {
+        size_t head = direct_align - misaligned;
+        if (head > len) head = len;
+        if (!write_at(ptr, head, offset)) return false;
+        ptr += head;
+        len -= head;
+        offset += head;
+        continue;
+      }
+
+      thread_info->direct_buffer = pool_get();
+      thread_info->direct_offset = offset;
+      thread_info->direct_len = 0;
+    }
+
+    size_t n = DIRECT_BUFFER_SIZE - thread_info->direct_len;
+    if (n > len) n = len;
+    memcpy(thread_info->direct_buffer + thread_info->direct_len, ptr, n);
+    thread_info->direct_len += n;
+    ptr += n;
+    len -= n;
+    offset += n;
+
+    // A full buffer is all whole blocks, write it straight away
+    if (thread_info->direct_len == DIRECT_BUFFER_SIZE &&
+        !direct_flush(thread_info))
+      return false;
+  }
+  return true;
+}
+
+// Flusher thread, writes out the file in order as the bytes after the flush
+// point come in, from the reorder buffer or read back from the spill file
+void *stream_worker(void *arg) {
+  while (stream.flushed < (unsigned long long)content_length) {
+    journal_collect();
+    unsigned long long ready = journal_contiguous(stream.flushed);
+    if (ready == stream.flushed) {
+      usleep(STREAM_POLL_US);
+      continue;
+    }
+
+    while (stream.flushed < ready) {
+      unsigned long long block = stream.flushed / JOURNAL_BLOCK_SIZE;
+      unsigned long long end = (block + 1) * JOURNAL_BLOCK_SIZE;
+      if (end > ready) end = ready;
+      size_t n = end - stream.flushed;
+
+      pthread_mutex_lock(&stream.mutex);
+      bool spilled = stream.spilled[block / 8] & (1 << (block % 8));
+      pthread_mutex_unlock(&stream.mutex);
+
+      char *data = stream.buffer + stream.flushed % stream.size;
+      if (spilled) {
+        data = stream.scratch;
+        ssize_t r = pread(output_fd, data, n, stream.flushed);
+        if (r != (ssize_t)n) {
+          char log[256];
+          snprintf(log, sizeof(log),
+                   RED "ERROR | Could not read spill file: %s, exiting...\n"
+                       RESET,
+                   r < 0 ? strerror(errno) : "file is short");
+          add_log(log);
+          stream.failed = true;
+          return NULL;
+        }
+      }
+
+      if (!digest_out(data, n, stream.flushed)) {
+        stream.failed = true;
+        return NULL;
+      }
+
+      for (size_t written = 0; !stream.failed && written < n;) {
+        ssize_t w = write(stream.fd, data + written, n - written);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) stream.failed = true;
+        if (w > 0) written += w;
+      }
+
+      if (stream.failed) {
+        char log[256];
+        snprintf(log, sizeof(log),
+                 RED "ERROR | Could not write to stdout: %s, exiting...\n"
+                     RESET,
+                 strerror(errno));
+        add_log(log);
+        return NULL;
+      }
+
+      // The window moves on, a spilled block gives its disk space back once
+      // it is out
+      pthread_mutex_lock(&stream.mutex);
+      __atomic_store_n(&stream.flushed, end, __ATOMIC_RELAXED);
+      pthread_mutex_unlock(&stream.mutex);
+      if (spilled && (end % JOURNAL_BLOCK_SIZE == 0 ||
+                      end == (unsigned long long)content_length))
+        fallocate(output_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                  block * JOURNAL_BLOCK_SIZE, JOURNAL_BLOCK_SIZE);
+    }
+  }
+  return NULL;
+}
+
+// Set up streaming a file of the given length to stdout. Out of order data
+// within the reorder buffer of the flush point is kept there, data further
+// ahead goes to an unlinked temporary file, and a flusher thread writes out
+// whatever is in order
+void stream_open(curl_off_t length) {
+  char path[PATH_MAX];
+  char *dir = getenv("TMPDIR");
+  snprintf(path, sizeof(path), "%s/mtdown-XXXXXX", dir && *dir ? dir : "/tmp");
+  output_fd = mkstemp(path);
+  if (output_fd >= 0) unlink(path);
+
+  // The buffer never needs to be larger than the file
+  unsigned long long size = settings.reorder_buffer;
+  unsigned long long blocks = (length + JOURNAL_BLOCK_SIZE - 1) /
+                              JOURNAL_BLOCK_SIZE;
+  if (size > blocks * JOURNAL_BLOCK_SIZE) size = blocks * JOURNAL_BLOCK_SIZE;
+  stream.size = size / JOURNAL_BLOCK_SIZE * JOURNAL_BLOCK_SIZE;
+  stream.buffer = malloc(stream.size);
+  stream.spilled = calloc((blocks + 7) / 8, 1);
+  stream.scratch = malloc(JOURNAL_BLOCK_SIZE);
+  stream.flushed = 0;
+  stream.failed = false;
+
+  // Check error
+  if (output_fd < 0 || stream.buffer == NULL || stream.spilled == NULL ||
+      stream.scratch == NULL) {
+    printf("ERROR | Could not set up streaming to stdout\n");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_mutex_init(&stream.mutex, NULL);
+  pthread_create(&stream.thread, NULL, stream_worker, NULL);
+}
+
+// Keep received data until it can be written out in order. Every block lives
+// in one place: the reorder buffer while it is within reach of the flush
+// point, otherwise the spill file, and once a block is spilled the rest of it
+// follows
+bool stream_write(char *ptr, size_t len, unsigned long long offset) {
+  while (len > 0) {
+    unsigned long long block = offset / JOURNAL_BLOCK_SIZE;
+    size_t n = (block + 1) * JOURNAL_BLOCK_SIZE - offset;
+    if (n > len) n = len;
+
+    pthread_mutex_lock(&stream.mutex);
+    // A losing hedge may still send bytes that are out already
+    bool sent = offset + n <= stream.flushed;
+    bool spill = !sent && (stream.spilled[block / 8] & (1 << (block % 8)) ||
+                           (block + 1) * JOURNAL_BLOCK_SIZE >
+                               stream.flushed / JOURNAL_BLOCK_SIZE *
+                                       JOURNAL_BLOCK_SIZE +
+                                   stream.size);
+    if (spill)
+      stream.spilled[block / 8] |= 1 << (block % 8);
+    else if (!sent)
+      memcpy(stream.buffer + offset % stream.size, ptr, n);
+    pthread_mutex_unlock(&stream.mutex);
+
+    if (spill && !write_at(ptr, n, offset)) return false;
+    ptr += n;
+    len -= n;
+    offset += n;
+  }
+  return true;
+}
+
+// Wait for the flusher to write out the whole file, or stop it if the
+// download did not finish. Returns whether all of the file went to stdout
+bool stream_finish(bool complete) {
+  if (!complete) pthread_cancel(stream.thread);
+  pthread_join(stream.thread, NULL);
+
+  free(stream.buffer);
+  free(stream.spilled);
+  free(stream.scratch);
+  return complete && !stream.failed;
+}
+
+// Write received data with the thread's disk writer
+bool output_write(DLThreadInfo *thread_info, char *ptr, size_t len,
+                  unsigned long long offset) {
+  switch (settings.io_mode) {
+    case IO_URING:
+      return ring_write(thread_info->ring, ptr, len, offset);
+    case IO_THREAD:
+      return writer_write(thread_info, ptr, len, offset);
+    case IO_MMAP:
+      memcpy(output_map + offset, ptr, len);
+      return true;
+    case IO_DIRECT:
+      return direct_write(thread_info, ptr, len, offset);
+    case IO_STREAM:
+      return stream_write(ptr, len, offset);
+    default:
+      return write_at(ptr, len, offset);
+  }
+}
+
+// Wait for pending writes and close the output file
+void close_output() {
+  stop_writers();
+  if (output_map) munmap(output_map, content_length);
+  if (direct_fd >= 0) close(direct_fd);
+  if (direct_pool.memory) free(direct_pool.memory);
+  if (direct_pool.free) free(direct_pool.free);
+  close(output_fd);
+}
+
+// Make sure everything the thread received has reached the file
+bool output_flush(DLThreadInfo *thread_info) {
+  switch (settings.io_mode) {
+    case IO_URING:
+      return ring_flush(thread_info->ring);
+    case IO_THREAD:
+      return writer_flush(thread_info);
+    case IO_MMAP:
+      return map_flush(thread_info);
+    case IO_DIRECT:
+      return direct_flush(thread_info);
+    default:
+      return true;
+  }
+}
+
+/* ===============================================================
+                          DOWNLOAD SETUP
+=============================================================== */
+// Print usage and the list of options
+void print_usage(char *name) {
+  fprintf(stderr,
+          "Usage: %s -u <url> [-u <mirror url>...] -o <filename> "
+          "-n <max_threads>\n",
+          name);
+  fprintf(stderr,
+          "       %s --metalink <file> [-o <filename>] -n <max_threads>\n",
+          name);
+  fprintf(stderr,
+          "       %s -i <url list|-> [-o <directory>] -n <max_threads>\n",
+          name);
+  fprintf(stderr,
+          "Options:\n"
+          "  --hedge-conns <n>     ranges hedged at once, 0 disables "
+          "(default %d)\n"
+          "  --hedge-bytes <size>  bytes hedges may download twice "
+          "(default %lluM)\n"
+          "  --io <sync|uring|thread|mmap|direct>\n"
+          "                        disk writer, uring falls back to sync "
+          "when unsupported (default sync)\n"
+          "  --writers <n>         writer threads for --io thread "
+          "(default %d)\n"
+          "  --direct-pool <size>  buffer memory for --io direct "
+          "(default %dM)\n"
+          "  --loops <n>           drive all connections from n event loop "
+          "threads, 0 for a thread per connection (default 0)\n"
+          "  --http2 <n>           send the ranges as streams of n HTTP/2 "
+          "connections, one per event loop (default off)\n"
+          "  --limit-rate <size>   bytes per second of the whole download "
+          "(default no limit)\n"
+          "  --conn-rate <size>    bytes per second of each connection "
+          "(default no limit)\n"
+          "  --host-conns <n>      connections per host in batch mode "
+          "(default max_threads)\n"
+          "  --small-size <size>   files up to this size are fetched with "
+          "one request (default %lluM)\n"
+          "  --reorder-buffer <size>\n"
+          "                        memory for out of order data with -o - "
+          "(default %dM)\n"
+          "  --sha256 <hex>        check the file's SHA-256 while it "
+          "downloads, also --sha1 and --md5\n"
+          "  --manifest <file>     check every piece against a manifest "
+          "and download bad ones again\n"
+          "  --verify              keep the pieces of an existing file that "
+          "match the manifest\n"
+          "  --save-manifest <file>\n"
+          "                        save the piece hashes of the file "
+          "(default piece size %dM)\n"
+          "  --piece-size <size>   bytes per piece of a saved manifest\n"
+          "  --metalink <file>     take URLs, length and hashes from a "
+          ".meta4 file instead of -u\n",
+          DEFAULT_HEDGE_CONNS, DEFAULT_HEDGE_BYTES / (1024 * 1024),
+          DEFAULT_WRITERS, DEFAULT_DIRECT_POOL / (1024 * 1024),
+          DEFAULT_SMALL_SIZE / (1024 * 1024),
+          DEFAULT_REORDER_BUFFER / (1024 * 1024),
+          DEFAULT_PIECE_SIZE / (1024 * 1024));
+}
+
+// Parse a byte count with an optional K, M or G suffix
+bool parse_size(char *str, unsigned long long *size) {
+  char *suffix;
+  unsigned long long value = strtoull(str, &suffix, 10);
+  if (suffix == str) return false;
+
+  switch (*suffix) {
+    case '\0':
+      break;
+    case 'k':
+    case 'K':
+      value *= 1024;
+      break;
+    case 'm':
+    case 'M':
+      value *= 1024 * 1024;
+      break;
+    case 'g':
+    case 'G':
+      value *= 1024 * 1024 * 1024;
+      break;
+    default:
+      return false;
+  }
+
+  *size = value;
+  return true;
+}
+
+// Use getopts to parse command line arguments
+void parse_args(int argc, char *argv[]) {
+  // ./mtdown -u <url> -o <filename> -n <max_threads> [options]
+  enum {
+    OPT_HEDGE_CONNS = 256,
+    OPT_HEDGE_BYTES,
+    OPT_IO,
+    OPT_WRITERS,
+    OPT_DIRECT_POOL,
+    OPT_LOOPS,
+    OPT_HTTP2,
+    OPT_LIMIT_RATE,
+    OPT_CONN_RATE,
+    OPT_HOST_CONNS,
+    OPT_SMALL_SIZE,
+    OPT_REORDER_BUFFER,
+    OPT_SHA256,
+    OPT_SHA1,
+    OPT_MD5,
+    OPT_MANIFEST,
+    OPT_VERIFY,
+    OPT_SAVE_MANIFEST,
+    OPT_PIECE_SIZE,
+    OPT_METALINK
+  };
+  struct option long_options[] = {
+      {"hedge-conns", required_argument, NULL, OPT_HEDGE_CONNS},
+      {"hedge-bytes", required_argument, NULL, OPT_HEDGE_BYTES},
+      {"io", required_argument, NULL, OPT_IO},
+      {"writers", required_argument, NULL, OPT_WRITERS},
+      {"direct-pool", required_argument, NULL, OPT_DIRECT_POOL},
+      {"loops", required_argument, NULL, OPT_LOOPS},
+      {"http2", required_argument, NULL, OPT_HTTP2},
+      {"limit-rate", required_argument, NULL, OPT_LIMIT_RATE},
+      {"conn-rate", required_argument, NULL, OPT_CONN_RATE},
+      {"host-conns", required_argument, NULL, OPT_HOST_CONNS},
+      {"small-size", required_argument, NULL, OPT_SMALL_SIZE},
+      {"reorder-buffer", required_argument, NULL, OPT_REORDER_BUFFER},
+      {"sha256", required_argument, NULL, OPT_SHA256},
+      {"sha1", required_argument, NULL, OPT_SHA1},
+      {"md5", required_argument, NULL, OPT_MD5},
+      {"manifest", required_argument, NULL, OPT_MANIFEST},
+      {"verify", no_argument, NULL, OPT_VERIFY},
+      {"save-manifest", required_argument, NULL, OPT_SAVE_MANIFEST},
+      {"piece-size", required_argument, NULL, OPT_PIECE_SIZE},
+      {"metalink", required_argument, NULL, OPT_METALINK},
+      {NULL, 0, NULL, 0}};
+
+  settings.hedge_conns = DEFAULT_HEDGE_CONNS;
+  settings.hedge_bytes = DEFAULT_HEDGE_BYTES;
+  settings.io_mode = IO_SYNC;
+  settings.writers = DEFAULT_WRITERS;
+  settings.direct_pool = DEFAULT_DIRECT_POOL;
+  settings.small_size = DEFAULT_SMALL_SIZE;
+  settings.reorder_buffer = DEFAULT_REORDER_BUFFER;
+  settings.piece_size = DEFAULT_PIECE_SIZE;
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "u:o:n:i:", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+      case 'u':
+        // Every -u after the first is a mirror of the same file
+        if (settings.url_count == MAX_MIRRORS) {
+          fprintf(stderr, "Error: at most %d URLs can be given\n",
+                  MAX_MIRRORS);
+          exit(EXIT_FAILURE);
+        }
+        settings.urls[settings.url_count++] = optarg;
+        settings.url = settings.urls[0];
+        break;
+      case 'i':
+        settings.input = optarg;
+        break;
+      case 'o':
+        settings.filename = optarg;
+        break;
+      case 'n':
+        // Check if optarg is a number using atoi
+        if (atoi(optarg) == 0) {
+          fprintf(stderr, "Error: max_threads must be a number\n");
+          exit(EXIT_FAILURE);
+        }
+        // Check if optarg is valid (1 - MAX_LOOP_CONNS), more than MAX_THREADS
+        // needs --loops which may come later
+        if (atoi(optarg) < 1 || atoi(optarg) > MAX_LOOP_CONNS) {
+          fprintf(stderr, "Error: max_threads must be between 1 and %d\n",
+                  MAX_LOOP_CONNS);
+          exit(EXIT_FAILURE);
+        }
+        settings.max_threads = atoi(optarg);
+        break;
+      case OPT_HEDGE_CONNS:
+        // Check if optarg is valid (0 - 32)
+        if (atoi(optarg) < 0 || atoi(optarg) > 32) {
+          fprintf(stderr, "Error: hedge-conns must be between 0 and 32\n");
+          exit(EXIT_FAILURE);
+        }
+        settings.hedge_conns = atoi(optarg);
+        break;
+      case OPT_HEDGE_BYTES:
+        if (!parse_size(optarg, &settings.hedge_bytes)) {
+          fprintf(stderr, "Error: hedge-bytes must be a size like 16M\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_IO:
+        if (strcmp(optarg, "sync") == 0) {
+          settings.io_mode = IO_SYNC;
+        } else if (strcmp(optarg, "uring") == 0) {
+          settings.io_mode = IO_URING;
+        } else if (strcmp(optarg, "thread") == 0) {
+          settings.io_mode = IO_THREAD;
+        } else if (strcmp(optarg, "mmap") == 0) {
+          settings.io_mode = IO_MMAP;
+        } else if (strcmp(optarg, "direct") == 0) {
+          settings.io_mode = IO_DIRECT;
+        } else {
+          fprintf(stderr,
+                  "Error: io must be sync, uring, thread, mmap or direct\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_WRITERS:
+        // Check if optarg is valid (1 - 8)
+        if (atoi(optarg) < 1 || atoi(optarg) > 8) {
+          fprintf(stderr, "Error: writers must be between 1 and 8\n");
+          exit(EXIT_FAILURE);
+        }
+        settings.writers = atoi(optarg);
+        break;
+      case OPT_DIRECT_POOL:
+        if (!parse_size(optarg, &settings.direct_pool) ||
+            settings.direct_pool < DIRECT_BUFFER_SIZE) {
+          fprintf(stderr, "Error: direct-pool must be a size of at least 1M\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_LOOPS:
+        // Check if optarg is valid (0 - MAX_LOOPS)
+        if (atoi(optarg) < 0 || atoi(optarg) > MAX_LOOPS) {
+          fprintf(stderr, "Error: loops must be between 0 and %d\n",
+                  MAX_LOOPS);
+          exit(EXIT_FAILURE);
+        }
+        settings.loops = atoi(optarg);
+        break;
+      case OPT_HTTP2:
+        // Check if optarg is valid (1 - MAX_LOOPS)
+        if (atoi(optarg) < 1 || atoi(optarg) > MAX_LOOPS) {
+          fprintf(stderr, "Error: http2 must be between 1 and %d\n",
+                  MAX_LOOPS);
+          exit(EXIT_FAILURE);
+        }
+        settings.http2 = atoi(optarg);
+        break;
+      case OPT_LIMIT_RATE:
+        if (!parse_size(optarg, &settings.rate_limit)) {
+          fprintf(stderr, "Error: limit-rate must be a size like 2M\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_CONN_RATE:
+        if (!parse_size(optarg, &settings.conn_rate)) {
+          fprintf(stderr, "Error: conn-rate must be a size like 512K\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_HOST_CONNS:
+        // Check if optarg is valid (1 - MAX_LOOP_CONNS)
+        if (atoi(optarg) < 1 || atoi(optarg) > MAX_LOOP_CONNS) {
+          fprintf(stderr, "Error: host-conns must be between 1 and %d\n",
+                  MAX_LOOP_CONNS);
+          exit(EXIT_FAILURE);
+        }
+        settings.host_conns = atoi(optarg);
+        break;
+      case OPT_SMALL_SIZE:
+        if (!parse_size(optarg, &settings.small_size) ||
+            settings.small_size == 0) {
+          fprintf(stderr, "Error: small-size must be a size like 4M\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_REORDER_BUFFER:
+        if (!parse_size(optarg, &settings.reorder_buffer) ||
+            settings.reorder_buffer < 1024 * 1024) {
+          fprintf(stderr,
+                  "Error: reorder-buffer must be a size of at least 1M\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_SHA256:
+      case OPT_SHA1:
+      case OPT_MD5:
+        settings.checksum_md = opt == OPT_SHA256 ? EVP_sha256()
+                               : opt == OPT_SHA1 ? EVP_sha1()
+                                                 : EVP_md5();
+        settings.checksum = optarg;
+        break;
+      case OPT_MANIFEST:
+        settings.manifest = optarg;
+        break;
+      case OPT_VERIFY:
+        settings.verify = true;
+        break;
+      case OPT_SAVE_MANIFEST:
+        settings.manifest_out = optarg;
+        break;
+      case OPT_PIECE_SIZE:
+        // Pieces are whole journal blocks
+        if (!parse_size(optarg, &settings.piece_size) ||
+            settings.piece_size == 0 ||
+            settings.piece_size % JOURNAL_BLOCK_SIZE != 0) {
+          fprintf(stderr, "Error: piece-size must be a multiple of %dK\n",
+                  JOURNAL_BLOCK_SIZE / 1024);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case OPT_METALINK:
+        settings.metalink = optarg;
+        break;
+      default:
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+  }
+
+  // A Metalink stands in for -u, its URLs are the mirrors
+  if (settings.metalink != NULL) {
+    if (settings.url != NULL || settings.input != NULL) {
+      fprintf(stderr, "Error: give either -u, -i or --metalink\n");
+      exit(EXIT_FAILURE);
+    }
+    if (settings.manifest != NULL) {
+      fprintf(stderr, "Error: a Metalink has its own piece hashes\n");
+      exit(EXIT_FAILURE);
+    }
+    metalink_load();
+  }
+
+  // Check if exactly one of url and url list is provided
+  if ((settings.url == NULL) == (settings.input == NULL)) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Check if filename is provided, batch mode saves to the current directory
+  // by default
+  if (settings.filename == NULL && settings.input == NULL) {
+    print_usage(argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  // Check if max_threads is provided
+  if (settings.max_threads == 0) {
+    settings.max_threads = DEFAULT_MAX_THREADS;
+  }
+
+  // "-o -" streams the file to stdout, whichever disk writer was asked for
+  if (settings.filename != NULL && strcmp(settings.filename, "-") == 0) {
+    if (settings.input != NULL) {
+      fprintf(stderr, "Error: batch mode cannot write to stdout\n");
+      exit(EXIT_FAILURE);
+    }
+    settings.io_mode = IO_STREAM;
+  }
+
+  // A checksum is the hex digest of one file
+  if (settings.checksum != NULL) {
+    size_t len = strlen(settings.checksum);
+    if (settings.input != NULL) {
+      fprintf(stderr, "Error: batch mode cannot check a checksum\n");
+      exit(EXIT_FAILURE);
+    }
+    if (len != (size_t)EVP_MD_get_size(settings.checksum_md) * 2 ||
+        strspn(settings.checksum, "0123456789abcdefABCDEF") != len) {
+      fprintf(stderr, "Error: %s must be %d hex digits\n",
+              EVP_MD_get0_name(settings.checksum_md),
+              EVP_MD_get_size(settings.checksum_md) * 2);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Pieces belong to one file, and --verify to a file that is already there
+  if (settings.input != NULL &&
+      (settings.manifest != NULL || settings.manifest_out != NULL)) {
+    fprintf(stderr, "Error: batch mode cannot use a manifest\n");
+    exit(EXIT_FAILURE);
+  }
+  if (settings.verify &&
+      ((settings.manifest == NULL && settings.metalink == NULL) ||
+       settings.io_mode == IO_STREAM)) {
+    fprintf(stderr,
+            "Error: verify needs a manifest or Metalink and an output file\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Streams can only share a connection inside one multi handle, every event
+  // loop keeps one HTTP/2 connection and sends its transfers over it
+  if (settings.http2 > 0) settings.loops = settings.http2;
+
+  // A thread and a stack per connection stop paying off long before that
+  // many connections do, a few event loops can drive far more of them
+  if (settings.max_threads > MAX_THREADS && settings.loops == 0) {
+    fprintf(stderr, "Error: more than %d connections need --loops\n",
+            MAX_THREADS);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Lock callback of the share handle, every kind of shared data has its own
+// mutex so DNS lookups do not wait on TLS sessions
+void share_lock(CURL *handle, curl_lock_data data, curl_lock_access access,
+                void *userptr) {
+  pthread_mutex_lock(&share_locks[data]);
+}
+
+// Unlock callback of the share handle
+void share_unlock(CURL *handle, curl_lock_data data, void *userptr) {
+  pthread_mutex_unlock(&share_locks[data]);
+}
+
+// Set up the share handle every curl handle uses, so the HEAD request, the
+// probes and the workers resolve the host and negotiate TLS once and resume
+// that session afterwards
+void setup_share() {
+  share = curl_share_init();
+
+  // Check error
+  if (share == NULL) {
+    printf("ERROR | Could not create curl share handle\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < CURL_LOCK_DATA_LAST; i++)
+    pthread_mutex_init(&share_locks[i], NULL);
+
+  curl_share_setopt(share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+  curl_share_setopt(share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+}
+
+// Keep the ETag, or else Last-Modified, of the last response to tell if the
+// file changed between runs
+void read_validator(CURL *curl, char *validator, size_t size) {
+  struct curl_header *header;
+  if (curl_easy_header(curl, "ETag", 0, CURLH_HEADER, -1, &header) ==
+          CURLHE_OK ||
+      curl_easy_header(curl, "Last-Modified", 0, CURLH_HEADER, -1, &header) ==
+          CURLHE_OK)
+    snprintf(validator, size, "%s", header->value);
+}
+
+// Block until setup_download has set up the file, only the first ranged GET
+// can get this far before that
+void wait_ready() {
+  pthread_mutex_lock(&scheduler.mutex);
+  while (scheduler.sizing != SIZE_READY)
+    pthread_cond_wait(&scheduler.cond, &scheduler.mutex);
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+// HTTP version of transfers to the URL with --http2. HTTPS negotiates HTTP/2
+// and falls back to HTTP/1.1, plain HTTP has no negotiation and needs a server
+// that speaks HTTP/2 without it. libcurl before 8.0 fails every stream after
+// the first on a cleartext HTTP/2 connection, plain HTTP stays on HTTP/1.1
+// there
+long http_version(char *url) {
+  if (strncasecmp(url, "http://", 7) != 0) return CURL_HTTP_VERSION_2TLS;
+  if (curl_version_info(CURLVERSION_NOW)->version_num < 0x080000)
+    return CURL_HTTP_VERSION_1_1;
+  return CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+}
+
+// Stop splitting the download once the server turns out to ignore Range, one
+// connection streams everything still missing from the lowest missing byte
+// on, the others give their ranges back. Call with scheduler.mutex held
+void enter_single(DLThreadArgs *self) {
+  if (scheduler.single) return;
+  scheduler.single = true;
+  scheduler.conn_limit = 1;
+  if (scheduler.sizing == SIZE_READY) {
+    for (int i = 0; i < settings.max_threads; i++)
+      if (thread_infos[i]->args != self) return_range(thread_infos[i]->args);
+  }
+  pthread_cond_broadcast(&scheduler.cond);
+
+  add_log(YELLOW " INFO | Host ignores Range, using a single connection.\n"
+                 RESET);
+}
+
+// Check a final response before any of its body is written. The first ranged
+// GET learns the length of the file from it, any other transfer must get the
+// bytes it asked for. A server that ignores Range answers with the whole file
+// from byte 0, what comes before the requested offset is dropped and no more
+// connections are opened for it. Returns false to fail the transfer
+bool check_response(DLThreadInfo *thread_info, long code) {
+  DLThreadArgs *thread_args = thread_info->args;
+
+  pthread_mutex_lock(&scheduler.mutex);
+  bool first = scheduler.sizing == SIZE_PENDING &&
+               scheduler.first == thread_args;
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  if (first) {
+    // Learn whether the host honors Range and its round trip time
+    curl_off_t connect = 0, lookup = 0;
+    curl_easy_getinfo(thread_info->curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(thread_info->curl, CURLINFO_NAMELOOKUP_TIME_T, &lookup);
+    if (connect > lookup) profile.rtt = (connect - lookup) / 1e6;
+    if (code == 200 || code == 206) profile.ranges = code == 206;
+
+    // Without HTTP/2 every transfer gets a connection of its own again
+    long version = 0;
+    curl_easy_getinfo(thread_info->curl, CURLINFO_HTTP_VERSION, &version);
+    if (settings.http2 > 0 && version != CURL_HTTP_VERSION_2_0 &&
+        http_version(settings.url) != CURL_HTTP_VERSION_1_1)
+      add_log(YELLOW " INFO | Host does not speak HTTP/2, using a connection "
+                     "per transfer.\n" RESET);
+
+    // A whole file is as good as its first range, it just becomes the only
+    // transfer and its Content-Length is the length
+    curl_off_t length = 0;
+    if (code == 206 && thread_info->content_from == 0)
+      length = thread_info->content_total;
+    if (code == 200)
+      curl_easy_getinfo(thread_info->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                        &length);
+
+    bool known = length > 0;
+    if (known)
+      read_validator(thread_info->curl, remote_validator,
+                     sizeof(remote_validator));
+
+    // With mirrors, the others may still honor Range. This transfer only
+    // gives the length, its range is retried once the mirrors are checked
+    bool single = code == 200 && mirror_count < 2;
+    pthread_mutex_lock(&scheduler.mutex);
+    if (single) enter_single(thread_args);
+    scheduler.first_length = known ? length : 0;
+    scheduler.sizing = known ? SIZE_KNOWN : SIZE_FAILED;
+    pthread_cond_broadcast(&scheduler.cond);
+    pthread_mutex_unlock(&scheduler.mutex);
+    return code != 200 || single;
+  }
+
+  // A mirror that ignores Range is left out while another one honors it, one
+  // connection for everything is the last resort
+  if (code == 200 && mirror_reject(thread_info, "ignores Range")) return false;
+  if (code == 200) {
+    thread_info->skip = thread_info->requested;
+    pthread_mutex_lock(&scheduler.mutex);
+    enter_single(thread_args);
+    pthread_mutex_unlock(&scheduler.mutex);
+    return true;
+  }
+
+  // A range starting elsewhere, or of a file of another length, would be
+  // written to the wrong place
+  if (code == 206 &&
+      (thread_info->content_from != (curl_off_t)thread_info->requested ||
+       (content_length > 0 && thread_info->content_total > 0 &&
+        thread_info->content_total != content_length))) {
+    char log[256];
+    snprintf(log, sizeof(log),
+             RED "ERROR | Thread %d: asked for bytes from %llu, got %lld of "
+                 "%lld.\n" RESET,
+             thread_args->index, thread_info->requested,
+             (long long)thread_info->content_from,
+             (long long)thread_info->content_total);
+    add_log(log);
+    mirror_reject(thread_info, "sent the wrong range");
+    return false;
+  }
+
+  return true;
+}
+
+// Header callback, keeps the Content-Range of each response and checks the
+// response once its headers are complete
+size_t header_callback(char *buffer, size_t size, size_t nitems,
+                       void *userdata) {
+  DLThreadInfo *thread_info = (DLThreadInfo *)userdata;
+  size_t len = size * nitems;
+
+  // Header lines are not NUL terminated
+  char line[256];
+  snprintf(line, sizeof(line), "%.*s", (int)len, buffer);
+
+  unsigned long long from, to;
+  int length_at = 0;
+  if (strncmp(line, "HTTP/", 5) == 0) {
+    // A new response, after a redirect or an interim one
+    thread_info->content_from = -1;
+    thread_info->content_total = 0;
+  } else if (strncasecmp(line, "Content-Range:", 14) == 0 &&
+             sscanf(line + 14, " bytes %llu-%llu/%n", &from, &to,
+                    &length_at) == 2 &&
+             length_at > 0) {
+    // The length may be left out as bytes a-b/*, which reads as 0
+    thread_info->content_from = from;
+    thread_info->content_total = strtoll(line + 14 + length_at, NULL, 10);
+  } else if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0) {
+    // End of the headers, unless more responses follow
+    long code = 0;
+    curl_easy_getinfo(thread_info->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code / 100 == 1 || code / 100 == 3) return len;
+
+    if (!check_response(thread_info, code)) return 0;
+  }
+
+  return len;
+}
+
+// Callback function for writing to buffer
+size_t write_callback(char *ptr, size_t size, size_t nmemb, void *userdata) {
+  // Get thread info and args
+  DLThreadInfo *thread_info = (DLThreadInfo *)userdata;
+  DLThreadArgs *args = thread_info->args;
+  size_t realsize = size * nmemb;
+
+  // The first ranged GET holds its data until the file exists
+  if (__atomic_load_n(&scheduler.sizing, __ATOMIC_ACQUIRE) != SIZE_READY)
+    wait_ready();
+
+  // Over a speed limit, hold off the sender until the limit catches up, curl
+  // keeps the data the same way as for a full writer queue
+  if (thread_info->throttled_until > 0 &&
+      get_time() < thread_info->throttled_until) {
+    thread_info->rate_paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  // With writer threads, hold off the sender while their queue is full, curl
+  // keeps the data and hands it over again once progress_callback resumes
+  if (settings.io_mode == IO_THREAD &&
+      !writer_reserve(thread_info, realsize)) {
+    thread_info->write_paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  // A whole-file response starts at byte 0, skip to the requested offset
+  size_t dropped = thread_info->skip < realsize ? thread_info->skip : realsize;
+  thread_info->skip -= dropped;
+  ptr += dropped;
+  realsize -= dropped;
+
+  // Claim bytes up to the end of the range, which a thief may have moved
+  pthread_mutex_lock(&args->lock);
+  size_t claimed = range_remaining(args);
+  if (claimed > realsize) claimed = realsize;
+  unsigned long long offset = args->pos;
+  args->pos += claimed;
+  stats_add(args->index, claimed, 0, 0);
+  pthread_mutex_unlock(&args->lock);
+  if (thread_info->mirror >= 0)
+    __atomic_add_fetch(&mirrors[thread_info->mirror].bytes, claimed,
+                       __ATOMIC_RELAXED);
+
+  // Note which mirror the bytes came from, in case their piece turns out bad
+  if (pieces.sources != NULL && thread_info->mirror >= 0 && claimed > 0) {
+    for (unsigned long long i = offset / pieces.size;
+         i <= (offset + claimed - 1) / pieces.size; i++)
+      __atomic_or_fetch(&pieces.sources[i], 1 << thread_info->mirror,
+                        __ATOMIC_RELAXED);
+  }
+
+  // Write to the claimed offset of the shared file, a failed write fails the
+  // transfer so the range is retried
+  if (!output_write(thread_info, ptr, claimed, offset)) {
+    char log[256];
+    snprintf(log, sizeof(log),
+             RED "ERROR | Thread %d: could not write to file: %s\n" RESET,
+             args->index, strerror(errno));
+    add_log(log);
+    return 0;
+  }
+
+  // Pay for the bytes, the connection holds off for whichever of the download's
+  // and its own limit is further behind
+  double wait = bucket_take(&bandwidth, claimed);
+  double own = bucket_take(&thread_info->bucket, claimed);
+  if (own > wait) wait = own;
+  if (wait > 0) {
+    // A thread that drives its own transfer simply sleeps it off, curl would
+    // only look at a paused transfer again about once a second. A loop has
+    // other transfers to serve, so there the connection is paused instead
+    if (thread_info->loop == NULL)
+      usleep(wait * 1e6);
+    else
+      thread_info->throttled_until = get_time() + wait;
+  }
+
+  // Every so often flush what the range has written so the journal can count
+  // it, a crash then only loses the bytes since the last checkpoint. What
+  // goes to a stream counts straight away, the flusher waits for it
+  if ((settings.io_mode == IO_STREAM ||
+       offset + claimed - args->durable >= CHECKPOINT_BYTES) &&
+      output_flush(thread_info)) {
+    pthread_mutex_lock(&args->lock);
+    args->durable = offset + claimed;
+    pthread_mutex_unlock(&args->lock);
+    digest_wake();
+  }
+
+  // Returning less than realsize makes curl stop the transfer, which is how a
+  // thread hands over the part of its range that was stolen
+  return dropped + claimed;
+}
+
+// Follow the global pause flag and resume a transfer held back by a full
+// writer queue or a speed limit once nothing holds it anymore. Only ever
+// called from the thread that drives the handle, since a curl handle must not
+// be used from two threads at once
+void sync_pause(DLThreadInfo *thread_info) {
+  bool held = thread_info->user_paused || thread_info->write_paused ||
+              thread_info->rate_paused;
+
+  thread_info->user_paused = paused;
+  if (thread_info->write_paused && writer_has_room(thread_info))
+    thread_info->write_paused = false;
+  if (thread_info->rate_paused && get_time() >= thread_info->throttled_until)
+    thread_info->rate_paused = false;
+
+  bool hold = thread_info->user_paused || thread_info->write_paused ||
+              thread_info->rate_paused;
+  if (hold && !held)
+    curl_easy_pause(thread_info->curl, CURLPAUSE_RECV);
+  else if (!hold && held)
+    curl_easy_pause(thread_info->curl, CURLPAUSE_CONT);
+}
+
+// Progress callback for stopping a transfer that lost a hedge, since a stalled
+// connection may not call write_callback again, and for pausing and resuming
+// from the thread that owns the transfer
+int progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+                      curl_off_t ultotal, curl_off_t ulnow) {
+  // Get thread info and args from clientp
+  DLThreadInfo *thread_info = (DLThreadInfo *)clientp;
+  DLThreadArgs *args = thread_info->args;
+
+  sync_pause(thread_info);
+
+  // Returning non-zero aborts the transfer
+  pthread_mutex_lock(&args->lock);
+  bool abandoned = args->abandoned;
+  pthread_mutex_unlock(&args->lock);
+
+  return abandoned || __atomic_load_n(&scheduler.stopping, __ATOMIC_RELAXED);
+}
+
+// Point the thread's handle at the rest of its range, starting from the last
+// byte that is already in the file, the end may already have been stolen from
+void range_request(DLThreadInfo *thread_info) {
+  DLThreadArgs *thread_args = thread_info->args;
+
+  pthread_mutex_lock(&thread_args->lock);
+  thread_info->requested = thread_args->durable;
+  char range[128];
+  if (thread_args->end == OPEN_END)
+    snprintf(range, sizeof(range), "%llu-", thread_info->requested);
+  else
+    snprintf(range, sizeof(range), "%llu-%llu", thread_info->requested,
+             thread_args->end);
+  pthread_mutex_unlock(&thread_args->lock);
+
+  // A new transfer starts unpaused, progress_callback pauses it again if the
+  // user still has the download paused
+  thread_info->user_paused = false;
+  thread_info->write_paused = false;
+  thread_info->rate_paused = false;
+  thread_info->skip = 0;
+  curl_easy_setopt(thread_info->curl, CURLOPT_RANGE, range);
+
+  // Every transfer goes to the mirror that has the most to spare for its speed
+  thread_info->mirror = mirror_pick();
+  curl_easy_setopt(thread_info->curl, CURLOPT_URL,
+                   mirrors[thread_info->mirror].url);
+
+  if (settings.http2 > 0)
+    curl_easy_setopt(thread_info->curl, CURLOPT_HTTP_VERSION,
+                     http_version(mirrors[thread_info->mirror].url));
+}
+
+// Settle a finished transfer of the thread's range, on failure work out how
+// long to back off before the next try
+DLAttempt range_result(DLThreadInfo *thread_info, CURLcode res,
+                       double *delay) {
+  DLThreadArgs *thread_args = thread_info->args;
+  char *errbuf = thread_info->errbuf;
+
+  // The first ranged GET may end before the file is set up, tell setup the
+  // length has to come from elsewhere and wait for it
+  if (__atomic_load_n(&scheduler.sizing, __ATOMIC_ACQUIRE) != SIZE_READY) {
+    pthread_mutex_lock(&scheduler.mutex);
+    if (scheduler.sizing == SIZE_PENDING) {
+      scheduler.sizing = SIZE_FAILED;
+      pthread_cond_broadcast(&scheduler.cond);
+    }
+    pthread_mutex_unlock(&scheduler.mutex);
+    wait_ready();
+  }
+
+  // Wait for buffered writes, a range only counts once it is in the file
+  bool written = output_flush(thread_info);
+  if (!written)
+    snprintf(errbuf, CURL_ERROR_SIZE, "could not write to file: %s",
+             strerror(errno));
+
+  // Everything written so far is in the file now
+  pthread_mutex_lock(&thread_args->lock);
+  if (written) thread_args->durable = thread_args->pos;
+  bool progressed = thread_args->durable > thread_info->requested;
+  pthread_mutex_unlock(&thread_args->lock);
+  if (progressed) digest_wake();
+
+  // A mirror only counts as failing when not even one byte came through
+  mirror_release(thread_info, res != CURLE_OK && !progressed &&
+                                  res != CURLE_ABORTED_BY_CALLBACK &&
+                                  res != CURLE_WRITE_ERROR);
+
+  if (res == CURLE_OK && written) return ATTEMPT_DONE;
+
+  // A stopped download gives up the range without retrying, only what is in
+  // the file stays counted
+  if (__atomic_load_n(&scheduler.stopping, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&thread_args->lock);
+    stats_add(thread_args->index,
+              -(curl_off_t)(thread_args->pos - thread_args->durable), 0, 0);
+    thread_args->pos = thread_args->durable;
+    pthread_mutex_unlock(&thread_args->lock);
+    return ATTEMPT_FAILED;
+  }
+
+  // Too many requests, service unavailable and refused connections are the
+  // server pushing back, the controller uses fewer connections
+  long code = 0;
+  curl_easy_getinfo(thread_info->curl, CURLINFO_RESPONSE_CODE, &code);
+  bool throttled = res == CURLE_COULDNT_CONNECT || code == 429 || code == 503;
+  if (throttled) __atomic_add_fetch(&scheduler.throttled, 1, __ATOMIC_RELAXED);
+
+  // That is no fault of the connection unless not even one gets through,
+  // others wait, or give their range to a thread still under the limit
+  if (throttled && thread_args->index > 0 && written) {
+    pthread_mutex_lock(&thread_args->lock);
+    stats_add(thread_args->index,
+              -(curl_off_t)(thread_args->pos - thread_args->durable), 0, 1);
+    thread_args->pos = thread_args->durable;
+    pthread_mutex_unlock(&thread_args->lock);
+
+    pthread_mutex_lock(&scheduler.mutex);
+    bool parked = thread_args->index >= scheduler.conn_limit &&
+                  return_range(thread_args);
+    pthread_mutex_unlock(&scheduler.mutex);
+
+    *delay = RETRY_BASE_MS;
+    return parked ? ATTEMPT_DONE : ATTEMPT_RETRY;
+  }
+
+  // An aborted transfer means the rest of the range was stolen or won by a
+  // hedge, nothing is wrong
+  pthread_mutex_lock(&thread_args->lock);
+  bool finished = range_remaining(thread_args) == 0;
+  pthread_mutex_unlock(&thread_args->lock);
+  if (finished && written) return ATTEMPT_DONE;
+
+  // A try that got data into the file starts the count over, only tries
+  // that make no progress at all count towards giving up
+  thread_info->failures = progressed ? 1 : thread_info->failures + 1;
+  bool giving_up = thread_info->failures == RETRY_TRIES;
+
+  // Back off exponentially with jitter, so threads that failed together do
+  // not all hit the server again at the same moment
+  *delay = RETRY_BASE_MS << (thread_info->failures - 1);
+  if (*delay > RETRY_MAX_MS) *delay = RETRY_MAX_MS;
+  *delay = *delay / 2 + *delay / 2 * rand_r(&thread_info->seed) / RAND_MAX;
+
+  // Add thread id and error to logs
+  char log[310];
+  if (giving_up)
+    snprintf(log, sizeof(log),
+             RED "ERROR | Thread %d: %s, exiting...\n" RESET,
+             thread_args->index, errbuf);
+  else
+    snprintf(log, sizeof(log),
+             RED "ERROR | Thread %d: %s, retrying in %.1fs...\n" RESET,
+             thread_args->index, errbuf, *delay / 1000);
+  add_log(log);
+
+  // Drop what was received but never made it to the file, the next try
+  // picks up from the last durable byte
+  pthread_mutex_lock(&thread_args->lock);
+  stats_add(thread_args->index,
+            -(curl_off_t)(thread_args->pos - thread_args->durable), 0,
+            giving_up ? 0 : 1);
+  thread_args->pos = thread_args->durable;
+  pthread_mutex_unlock(&thread_args->lock);
+
+  return giving_up ? ATTEMPT_FAILED : ATTEMPT_RETRY;
+}
+
+// Sleep off a retry backoff, waking early when the download is stopped
+void backoff_sleep(double delay) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  long ms = delay;
+  ts.tv_sec += ms / 1000;
+  ts.tv_nsec += ms % 1000 * 1000000L;
+  ts.tv_sec += ts.tv_nsec / 1000000000L;
+  ts.tv_nsec %= 1000000000L;
+
+  pthread_mutex_lock(&scheduler.mutex);
+  while (!scheduler.stopping &&
+         pthread_cond_timedwait(&scheduler.cond, &scheduler.mutex, &ts) !=
+             ETIMEDOUT)
+    ;
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+// Download the thread's current range, retrying with backoff until it is done
+// or the tries run out
+bool download_range(DLThreadInfo *thread_info) {
+  thread_info->failures = 0;
+
+  while (true) {
+    range_request(thread_info);
+    CURLcode res = curl_easy_perform(thread_info->curl);
+
+    double delay;
+    switch (range_result(thread_info, res, &delay)) {
+      case ATTEMPT_DONE:
+        return true;
+      case ATTEMPT_FAILED:
+        return false;
+      default:
+        backoff_sleep(delay);
+        if (__atomic_load_n(&scheduler.stopping, __ATOMIC_RELAXED))
+          return false;
+    }
+  }
+}
+
+// Set the options every range transfer of a thread shares, the connection is
+// reused between ranges
+void setup_handle(DLThreadInfo *thread_info) {
+  CURL *curl = thread_info->curl;
+  curl_easy_setopt(curl, CURLOPT_URL, settings.url);
+  curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, thread_info);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, thread_info);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "mtdown/1.0");
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_NOPROGRESS, 0L);
+  curl_easy_setopt(curl, CURLOPT_XFERINFOFUNCTION, progress_callback);
+  curl_easy_setopt(curl, CURLOPT_XFERINFODATA, thread_info);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, thread_info->errbuf);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, thread_info);
+
+  // Wait for the loop's connection to say whether it multiplexes instead of
+  // opening one per transfer, and read more of it per call since every
+  // stream arrives through it
+  if (settings.http2 > 0) {
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_BUFFERSIZE, HTTP2_BUFFER_SIZE);
+  }
+}
+
+// Mark one more thread or connection as out of work
+void mark_completed() {
+  pthread_mutex_lock(&completed_mutex);
+  completed_counter++;
+  pthread_mutex_unlock(&completed_mutex);
+}
+
+// Keep pulling ranges from the scheduler and download each part of the
+// buffer until there is no work left
+void *download_worker(void *info) {
+  // Get thread info and args
+  DLThreadInfo *thread_info = (DLThreadInfo *)info;
+  DLThreadArgs *thread_args = thread_info->args;
+
+  setup_handle(thread_info);
+
+  // Download ranges until the queue is empty and nothing is left to steal
+  while (next_range(thread_args)) {
+    if (!download_range(thread_info)) break;
+  }
+
+  // Cleanup curl
+  curl_easy_cleanup(thread_info->curl);
+
+  // Increase completed counter
+  mark_completed();
+
+  return NULL;
+}
+
+// Socket callback of a loop's multi handle, keeps epoll watching what curl
+// wants to know about each socket
+int loop_socket_callback(CURL *easy, curl_socket_t s, int what, void *userp,
+                         void *socketp) {
+  DLLoop *loop = (DLLoop *)userp;
+
+  if (what == CURL_POLL_REMOVE) {
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, s, NULL);
+    return 0;
+  }
+
+  struct epoll_event event = {0};
+  event.data.fd = s;
+  if (what & CURL_POLL_IN) event.events |= EPOLLIN;
+  if (what & CURL_POLL_OUT) event.events |= EPOLLOUT;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, s, &event) != 0 &&
+      errno == ENOENT)
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, s, &event);
+  return 0;
+}
+
+// Timer callback of a loop's multi handle, remembers when curl wants to
+// handle its timeouts
+int loop_timer_callback(CURLM *multi, long timeout_ms, void *userp) {
+  DLLoop *loop = (DLLoop *)userp;
+  loop->timer_at = timeout_ms < 0 ? -1 : get_time() + timeout_ms / 1000.0;
+  return 0;
+}
+
+// Hand the connection's range to its loop
+void conn_start(DLThreadInfo *thread_info) {
+  range_request(thread_info);
+  thread_info->state = CONN_ACTIVE;
+  curl_multi_add_handle(thread_info->loop->multi, thread_info->curl);
+}
+
+// Stop driving a connection that has no work left
+void conn_stop(DLThreadInfo *thread_info) {
+  thread_info->state = CONN_DONE;
+  mark_completed();
+}
+
+// Ask the scheduler for a range without blocking the loop, a connection that
+// has to wait asks again after HEDGE_POLL_US
+void conn_take(DLThreadInfo *thread_info) {
+  pthread_mutex_lock(&scheduler.mutex);
+  DLTake take = take_range(thread_info->args);
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  if (take == TAKE_FOUND) {
+    thread_info->failures = 0;
+    conn_start(thread_info);
+  } else if (take == TAKE_WAIT) {
+    // Until setup is done, look again on every pass of the loop
+    thread_info->state = CONN_POLL;
+    thread_info->wake_at = get_time();
+    if (__atomic_load_n(&scheduler.sizing, __ATOMIC_ACQUIRE) == SIZE_READY)
+      thread_info->wake_at += HEDGE_POLL_US / 1e6;
+  } else {
+    conn_stop(thread_info);
+  }
+}
+
+// Finish the connection's range and move on to the next one
+void conn_next(DLThreadInfo *thread_info) {
+  pthread_mutex_lock(&scheduler.mutex);
+  finish_range(thread_info->args);
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  conn_take(thread_info);
+}
+
+// Settle a transfer the loop took out of its multi handle
+void conn_finished(DLThreadInfo *thread_info, CURLcode res) {
+  double delay;
+  switch (range_result(thread_info, res, &delay)) {
+    case ATTEMPT_DONE:
+      conn_next(thread_info);
+      break;
+    case ATTEMPT_FAILED:
+      conn_stop(thread_info);
+      break;
+    default:
+      thread_info->state = CONN_BACKOFF;
+      thread_info->wake_at = get_time() + delay / 1000;
+  }
+}
+
+// Take finished transfers out of the loop's multi handle
+void loop_reap(DLLoop *loop) {
+  CURLMsg *msg;
+  int left;
+  while ((msg = curl_multi_info_read(loop->multi, &left)) != NULL) {
+    if (msg->msg != CURLMSG_DONE) continue;
+
+    DLThreadInfo *thread_info;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &thread_info);
+    CURLcode res = msg->data.result;
+    curl_multi_remove_handle(loop->multi, msg->easy_handle);
+    conn_finished(thread_info, res);
+  }
+}
+
+// Go over the loop's connections: apply pauses, stop transfers that lost a
+// hedge or belong to a stopped download, and wake connections whose wait is
+// over. Returns how many connections still have work
+int loop_sweep(DLLoop *loop) {
+  int running = 0;
+  double now = get_time();
+  bool stopping = __atomic_load_n(&scheduler.stopping, __ATOMIC_RELAXED);
+
+  for (int i = loop->index; i < settings.max_threads; i += settings.loops) {
+    DLThreadInfo *thread_info = thread_infos[i];
+
+    if (stopping && thread_info->state == CONN_ACTIVE) {
+      curl_multi_remove_handle(loop->multi, thread_info->curl);
+      conn_finished(thread_info, CURLE_ABORTED_BY_CALLBACK);
+    } else if (stopping && thread_info->state != CONN_DONE) {
+      conn_stop(thread_info);
+    } else if (thread_info->state == CONN_ACTIVE) {
+      sync_pause(thread_info);
+
+      // A stalled transfer never reaches progress_callback, stop it here
+      pthread_mutex_lock(&thread_info->args->lock);
+      bool abandoned = thread_info->args->abandoned;
+      pthread_mutex_unlock(&thread_info->args->lock);
+      if (abandoned) {
+        curl_multi_remove_handle(loop->multi, thread_info->curl);
+        conn_finished(thread_info, CURLE_ABORTED_BY_CALLBACK);
+      }
+    } else if (thread_info->state == CONN_BACKOFF &&
+               now >= thread_info->wake_at) {
+      conn_start(thread_info);
+    } else if (thread_info->state == CONN_POLL &&
+               now >= thread_info->wake_at) {
+      conn_take(thread_info);
+    }
+
+    if (thread_info->state != CONN_DONE) running++;
+  }
+
+  return running;
+}
+
+// Drive a share of the connections from one thread, waiting on all of their
+// sockets at once with epoll instead of blocking in curl_easy_perform
+void *loop_worker(void *arg) {
+  DLLoop *loop = (DLLoop *)arg;
+  struct epoll_event events[LOOP_EVENTS];
+  int handles;
+
+  for (int i = loop->index; i < settings.max_threads; i += settings.loops) {
+    thread_infos[i]->loop = loop;
+    setup_handle(thread_infos[i]);
+    conn_next(thread_infos[i]);
+  }
+
+  while (loop_sweep(loop) > 0) {
+    // Sleep until a socket is ready or curl's timer is due, but never longer
+    // than a tick so pauses and waiting connections are handled in time
+    int wait = LOOP_TICK_MS;
+    if (loop->timer_at >= 0) {
+      double due = (loop->timer_at - get_time()) * 1000;
+      if (due < wait) wait = due > 0 ? due : 0;
+    }
+
+    int count = epoll_wait(loop->epoll_fd, events, LOOP_EVENTS, wait);
+    for (int i = 0; i < count; i++) {
+      int flags = 0;
+      if (events[i].events & EPOLLIN) flags |= CURL_CSELECT_IN;
+      if (events[i].events & EPOLLOUT) flags |= CURL_CSELECT_OUT;
+      if (events[i].events & (EPOLLERR | EPOLLHUP)) flags |= CURL_CSELECT_ERR;
+      curl_multi_socket_action(loop->multi, events[i].data.fd, flags,
+                               &handles);
+    }
+
+    // Clear the timer first, curl sets a new one from inside the call
+    if (loop->timer_at >= 0 && get_time() >= loop->timer_at) {
+      loop->timer_at = -1;
+      curl_multi_socket_action(loop->multi, CURL_SOCKET_TIMEOUT, 0, &handles);
+    }
+
+    loop_reap(loop);
+  }
+
+  // Cleanup curl
+  for (int i = loop->index; i < settings.max_threads; i += settings.loops)
+    curl_easy_cleanup(thread_infos[i]->curl);
+  curl_multi_cleanup(loop->multi);
+  close(loop->epoll_fd);
+
+  return NULL;
+}
+
+// Create the event loops and start them, connection i is driven by loop
+// i % settings.loops
+void start_loops() {
+  // More loops than connections would leave some with nothing to drive
+  if (settings.loops > settings.max_threads)
+    settings.loops = settings.max_threads;
+
+  loops = calloc(settings.loops, sizeof(DLLoop));
+
+  // Check error
+  if (loops == NULL) {
+    printf("ERROR | Could not allocate event loops\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < settings.loops; i++) {
+    loops[i].index = i;
+    loops[i].timer_at = -1;
+    loops[i].multi = curl_multi_init();
+    loops[i].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    // Check error
+    if (loops[i].multi == NULL || loops[i].epoll_fd < 0) {
+      printf("ERROR | Could not create event loop %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    curl_multi_setopt(loops[i].multi, CURLMOPT_SOCKETFUNCTION,
+                      loop_socket_callback);
+    curl_multi_setopt(loops[i].multi, CURLMOPT_SOCKETDATA, &loops[i]);
+    curl_multi_setopt(loops[i].multi, CURLMOPT_TIMERFUNCTION,
+                      loop_timer_callback);
+    curl_multi_setopt(loops[i].multi, CURLMOPT_TIMERDATA, &loops[i]);
+
+    // Let every connection of the loop carry as many streams as it drives
+    if (settings.http2 > 0) {
+      curl_multi_setopt(loops[i].multi, CURLMOPT_PIPELINING,
+                        CURLPIPE_MULTIPLEX);
+      curl_multi_setopt(loops[i].multi, CURLMOPT_MAX_CONCURRENT_STREAMS,
+                        (long)settings.max_threads);
+    }
+  }
+
+  for (int i = 0; i < settings.loops; i++)
+    pthread_create(&loops[i].thread, NULL, loop_worker, &loops[i]);
+}
+
+// Start the threads, or the event loops, that download the ranges. They start
+// before the file is set up, the first one sends the first ranged GET and the
+// others wait until setup_download lets them go
+void start_workers() {
+  if (settings.loops > 0) {
+    char log[256];
+    if (settings.http2 > 0)
+      snprintf(log, sizeof(log),
+               GREY " INFO | Up to %d streams over %d HTTP/2 connections.\n"
+                    RESET,
+               settings.max_threads,
+               settings.loops < settings.max_threads ? settings.loops
+                                                     : settings.max_threads);
+    else
+      snprintf(log, sizeof(log),
+               GREY " INFO | %d connections driven by %d event loops.\n" RESET,
+               settings.max_threads, settings.loops);
+    add_log(log);
+
+    if (settings.http2 > 0 &&
+        http_version(settings.url) == CURL_HTTP_VERSION_1_1) {
+      snprintf(log, sizeof(log),
+               YELLOW " INFO | libcurl %s cannot multiplex plain HTTP, using "
+                      "a connection per transfer.\n" RESET,
+               curl_version_info(CURLVERSION_NOW)->version);
+      add_log(log);
+    }
+    start_loops();
+    return;
+  }
+
+  for (int i = 0; i < settings.max_threads; i++) {
+    // Add download started to log
+    char log[256];
+    snprintf(log, sizeof(log),
+             GREY " INFO | Thread %d started downloading.\n" RESET, i);
+    add_log(log);
+
+    // Create thread
+    pthread_create(&thread_infos[i]->thread, NULL, download_worker,
+                   thread_infos[i]);
+  }
+}
+
+// Fetch the length and validator with a HEAD request, only used when the
+// first ranged GET did not say how long the file is
+curl_off_t head_length() {
+  CURL *curl = curl_easy_init();
+  curl_easy_setopt(curl, CURLOPT_URL, settings.url);
+  curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_perform(curl);
+  curl_off_t res = 0;
+  curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &res);
+  read_validator(curl, remote_validator, sizeof(remote_validator));
+  curl_easy_cleanup(curl);
+  return res;
+}
+
+// Compare the other mirrors with the first URL once its length and validator
+// are known, a HEAD request to each at once. A mirror with a different length
+// or validator serves some other file and is never used
+void check_mirrors(curl_off_t length) {
+  if (mirror_count < 2) return;
+
+  // The URLs of a Metalink are the same file by its word, nothing to ask.
+  // Every range still has to come with the length the Metalink gives
+  if (settings.metalink != NULL) {
+    pthread_mutex_lock(&mirror_mutex);
+    for (int i = 1; i < mirror_count; i++) mirrors[i].state = MIRROR_OK;
+    pthread_mutex_unlock(&mirror_mutex);
+
+    for (int i = 0; i < mirror_count; i++) {
+      DLMetalinkURL *url = &metalink.urls[i];
+      printf(BOLD "Using mirror %s" RESET, url->url);
+      if (url->priority != METALINK_NO_PRIORITY)
+        printf(", priority %d", url->priority);
+      if (*url->location) printf(", in %s", url->location);
+      printf("\n");
+    }
+    return;
+  }
+
+  CURLM *multi = curl_multi_init();
+  CURL *handles[MAX_MIRRORS];
+  for (int i = 1; i < mirror_count; i++) {
+    handles[i] = curl_easy_init();
+    curl_easy_setopt(handles[i], CURLOPT_URL, mirrors[i].url);
+    curl_easy_setopt(handles[i], CURLOPT_SHARE, share);
+    curl_easy_setopt(handles[i], CURLOPT_NOBODY, 1L);
+    curl_easy_setopt(handles[i], CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(handles[i], CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(handles[i], CURLOPT_USERAGENT, "mtdown/1.0");
+    curl_multi_add_handle(multi, handles[i]);
+  }
+
+  int running;
+  do {
+    curl_multi_perform(multi, &running);
+    if (running) curl_multi_poll(multi, NULL, 0, 1000, NULL);
+  } while (running);
+
+  for (int i = 1; i < mirror_count; i++) {
+    curl_off_t mirror_length = -1;
+    char validator[1024] = "";
+    curl_easy_getinfo(handles[i], CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &mirror_length);
+    read_validator(handles[i], validator, sizeof(validator));
+
+    long code = 0;
+    curl_easy_getinfo(handles[i], CURLINFO_RESPONSE_CODE, &code);
+    bool reached = code >= 200 && code < 300;
+    bool same = reached && mirror_length == length &&
+                (!*validator || !*remote_validator ||
+                 strcmp(validator, remote_validator) == 0);
+    pthread_mutex_lock(&mirror_mutex);
+    mirrors[i].state = same ? MIRROR_OK : MIRROR_BAD;
+    pthread_mutex_unlock(&mirror_mutex);
+
+    if (same)
+      printf(BOLD "Using mirror %s\n" RESET, mirrors[i].url);
+    else if (!reached)
+      printf(RED BOLD "Not using mirror %s, it could not be reached\n" RESET,
+             mirrors[i].url);
+    else
+      printf(RED BOLD "Not using mirror %s, it serves a different file\n" RESET,
+             mirrors[i].url);
+
+    curl_multi_remove_handle(multi, handles[i]);
+    curl_easy_cleanup(handles[i]);
+  }
+  curl_multi_cleanup(multi);
+}
+
+void setup_download() {
+  // Setup global thread_info array
+  thread_infos = malloc(sizeof(DLThreadInfo *) * settings.max_threads);
+
+  // Check error
+  if (thread_infos == NULL) {
+    printf("ERROR | Could not allocate thread_infos\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Allocate progress, threads add to it as they take ranges. Each thread's
+  // counters sit on a cache line of their own
+  progress.threads =
+      aligned_alloc(CACHE_LINE, settings.max_threads * sizeof(DLStats));
+
+  // Check error
+  if (progress.threads == NULL) {
+    printf("ERROR | Could not allocate progress\n");
+    exit(EXIT_FAILURE);
+  }
+  memset(progress.threads, 0, settings.max_threads * sizeof(DLStats));
+
+  // Set paused to false
+  paused = false;
+
+  // Setup worker threads using global threads array
+  for (int i = 0; i < settings.max_threads; i++) {
+    // Allocate spot in thread_info array
+    thread_infos[i] = malloc(sizeof(DLThreadInfo));
+
+    // Check error
+    if (thread_infos[i] == NULL) {
+      printf("ERROR | Could not allocate thread_info for thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    // Allocate args
+    thread_infos[i]->args = malloc(sizeof(DLThreadArgs));
+
+    // Check error
+    if (thread_infos[i]->args == NULL) {
+      printf("ERROR | Could not allocate thread_args for thread %d\n", i);
+      exit(EXIT_FAILURE);
+    }
+
+    // No range yet, the scheduler hands one out when the thread starts
+    thread_infos[i]->args->index = i;
+    thread_infos[i]->args->start = 0;
+    thread_infos[i]->args->end = 0;
+    thread_infos[i]->args->pos = 1;
+    thread_infos[i]->args->durable = 0;
+    thread_infos[i]->args->abandoned = false;
+    thread_infos[i]->args->partner = NULL;
+    pthread_mutex_init(&thread_infos[i]->args->lock, NULL);
+
+    // Assign the rest of the thread info
+    thread_infos[i]->curl = curl_easy_init();
+    thread_infos[i]->ring = NULL;
+    thread_infos[i]->writer = NULL;
+    thread_infos[i]->slot = NULL;
+    thread_infos[i]->queued = 0;
+    thread_infos[i]->written = 0;
+    thread_infos[i]->write_error = 0;
+    thread_infos[i]->write_paused = false;
+    thread_infos[i]->direct_buffer = NULL;
+    thread_infos[i]->direct_len = 0;
+    thread_infos[i]->failures = 0;
+    thread_infos[i]->seed = (unsigned int)time(NULL) + i;
+    thread_infos[i]->user_paused = false;
+    thread_infos[i]->rate_paused = false;
+    thread_infos[i]->throttled_until = 0;
+    thread_infos[i]->bucket.due = 0;
+    thread_infos[i]->mirror = -1;
+    thread_infos[i]->content_from = -1;
+    thread_infos[i]->content_total = 0;
+    thread_infos[i]->skip = 0;
+    thread_infos[i]->loop = NULL;
+    thread_infos[i]->state = CONN_POLL;
+    thread_infos[i]->wake_at = 0;
+  }
+
+  // The first URL is used until the others are checked
+  setup_mirrors();
+
+  // Apply the speed limits before any data comes in
+  set_rate_limits(settings.rate_limit, settings.conn_rate);
+
+  // Start the threads right away, the first ranged GET goes out while the
+  // file is set up and tells us its length with Content-Range
+  pthread_mutex_init(&scheduler.mutex, NULL);
+  pthread_cond_init(&scheduler.cond, NULL);
+  scheduler.sizing = SIZE_PENDING;
+  scheduler.conn_limit = settings.max_threads < INITIAL_CONNS
+                             ? settings.max_threads
+                             : INITIAL_CONNS;
+
+  // Start from what an earlier run learned about the host, the controller
+  // holds there and only probes for more every so often. A host known to
+  // ignore Range gets the HEAD request straight away. Its mirrors may still
+  // honor Range, so with mirrors such a profile is no guide
+  if (profile.loaded && (profile.ranges != 0 || mirror_count < 2)) {
+    scheduler.conn_limit = settings.max_threads < profile.conns
+                               ? settings.max_threads
+                               : profile.conns;
+    controller.settled = true;
+    controller.settled_at = get_time();
+    if (profile.ranges == 0) {
+      scheduler.sizing = SIZE_FAILED;
+      enter_single(NULL);
+    }
+
+    char log[512];
+    snprintf(log, sizeof(log),
+             GREY " INFO | Using saved profile of %s: %d connections, "
+                  "%.0f ms RTT.\n" RESET,
+             profile.host, profile.conns, profile.rtt * 1000);
+    add_log(log);
+  }
+
+  // A Metalink gives the length, so the ranges go out without a first GET or
+  // HEAD. Its hash tells a resumed file apart from another version
+  if (metalink.size > 0 && scheduler.sizing == SIZE_PENDING) {
+    scheduler.sizing = SIZE_KNOWN;
+    scheduler.first_length = metalink.size;
+  }
+  if (metalink.hash_md != NULL)
+    snprintf(remote_validator, sizeof(remote_validator), "%s:%s",
+             hash_name(metalink.hash_md), metalink.hash);
+  start_workers();
+
+  pthread_mutex_lock(&scheduler.mutex);
+  while (scheduler.sizing == SIZE_PENDING)
+    pthread_cond_wait(&scheduler.cond, &scheduler.mutex);
+  bool sized = scheduler.sizing == SIZE_KNOWN;
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  // Fall back to a HEAD request when the server did not answer with a range
+  curl_off_t res = sized               ? scheduler.first_length
+                   : metalink.size > 0 ? metalink.size
+                                       : head_length();
+
+  // Check if content length is valid
+  if (res <= 0) {
+    printf("ERROR | Could not fetch content length\n");
+    exit(EXIT_FAILURE);
+  }
+
+  content_length = res;
+
+  // Check the other mirrors serve the same file
+  check_mirrors(res);
+
+  // Load the piece hashes to check the file against, or set up the ones to
+  // save
+  if (settings.manifest != NULL)
+    manifest_load(res);
+  else if (!metalink_pieces(res) && settings.manifest_out != NULL)
+    pieces_setup(EVP_sha256(), settings.piece_size, res);
+
+  // Pick up an earlier run of the same download if its journal and file are
+  // both still there
+  journal_init(res, remote_validator);
+  struct stat st;
+  bool resuming = !scheduler.single && settings.io_mode != IO_STREAM &&
+                  stat(settings.filename, &st) == 0 && st.st_size == res &&
+                  journal_load(res, remote_validator);
+
+  // Without a journal, --verify takes the whole file as downloaded, the
+  // pieces that do not match the manifest are dropped and fetched again
+  bool verifying = !resuming && settings.verify && !scheduler.single &&
+                   pieces.expected != NULL &&
+                   stat(settings.filename, &st) == 0 && st.st_size == res;
+  if (verifying) {
+    journal_add(0, res);
+    journal.resumed_bytes = res;
+    resuming = true;
+    printf(BOLD "\nVerifying %s against %s\n" RESET, settings.filename,
+           settings.manifest != NULL ? settings.manifest : settings.metalink);
+  } else if (resuming) {
+    printf(BOLD "\nResuming %s, %.2f MB already downloaded\n" RESET,
+           settings.filename, (double)journal.resumed_bytes / 1000000);
+  } else {
+    // Check if file exists, asks user if they want to overwrite unless that
+    // is settled already
+    FILE *file =
+        settings.io_mode == IO_STREAM ? NULL : fopen(settings.filename, "r");
+    if (file != NULL && overwrite_ok) {
+      fclose(file);
+    } else if (file != NULL) {
+      fclose(file);
+      printf(RED BOLD "\nFile %s already exists, overwrite? (y/n) " RESET,
+             settings.filename);
+      char c;
+      scanf("%c", &c);
+      if (c == 'n') exit(EXIT_SUCCESS);
+    }
+  }
+
+  // A stream never has the whole file anywhere, only what came out of order
+  bool allocated = false;
+  if (settings.io_mode == IO_STREAM) {
+    stream_open(res);
+  } else {
+    // Create file of size res, opened once and shared by all threads, a
+    // resumed file keeps what is already in it
+    output_fd = open(settings.filename,
+                     O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC), 0644);
+
+    // Check error
+    if (output_fd < 0) {
+      printf("ERROR | Could not create file %s\n", settings.filename);
+      exit(EXIT_FAILURE);
+    }
+
+    // Allocate size of res, falling back to a sparse file where fallocate is
+    // not supported
+    allocated = fallocate(output_fd, 0, 0, res) == 0;
+    if (!allocated && ftruncate(output_fd, res) != 0) {
+      printf("ERROR | Could not allocate file %s\n", settings.filename);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Map the file for IO_MMAP, but only once its blocks are really allocated
+  // since running out of space under a mapping kills the process with SIGBUS
+  if (settings.io_mode == IO_MMAP && (!allocated || !map_output(res))) {
+    settings.io_mode = IO_SYNC;
+
+    char log[256];
+    snprintf(log, sizeof(log),
+             YELLOW " INFO | Could not map %s, using pwrite.\n" RESET,
+             settings.filename);
+    add_log(log);
+  }
+
+  // Open the O_DIRECT side for IO_DIRECT, tmpfs and some others refuse it
+  if (settings.io_mode == IO_DIRECT && !open_direct()) {
+    settings.io_mode = IO_SYNC;
+
+    char log[256];
+    snprintf(log, sizeof(log),
+             YELLOW " INFO | O_DIRECT unsupported for %s, using pwrite.\n" RESET,
+             settings.filename);
+    add_log(log);
+  }
+
+  // Cut what is missing into work units, the threads are still waiting
+  setup_scheduler(res);
+
+  // Spread threads over the writer threads, each thread always queues to the
+  // same writer so its data is written in the order it arrived
+  if (settings.io_mode == IO_THREAD) {
+    start_writers();
+    for (int i = 0; i < settings.max_threads; i++)
+      thread_infos[i]->writer = &writers[i % settings.writers];
+  }
+
+  // Give each thread its own io_uring, falling back to synchronous writes if
+  // the kernel does not support it
+  if (settings.io_mode == IO_URING) {
+    for (int i = 0; i < settings.max_threads; i++) {
+      thread_infos[i]->ring = ring_create();
+      if (thread_infos[i]->ring != NULL) continue;
+
+      for (int j = 0; j < i; j++) {
+        ring_destroy(thread_infos[j]->ring);
+        thread_infos[j]->ring = NULL;
+      }
+      settings.io_mode = IO_SYNC;
+
+      char log[256];
+      snprintf(log, sizeof(log),
+               YELLOW " INFO | io_uring unavailable (%s), using pwrite.\n" RESET,
+               strerror(errno));
+      add_log(log);
+      break;
+    }
+  }
+
+  // Hash the file in order while it comes in, starting with what an earlier
+  // run left in it
+  digest_start();
+
+  // Let the threads go. The first ranged GET keeps streaming into the first
+  // unit when that one is still missing, otherwise it is stopped
+  pthread_mutex_lock(&scheduler.mutex);
+  DLThreadArgs *first = scheduler.first;
+  if (first != NULL) {
+    pthread_mutex_lock(&first->lock);
+    if (sized && scheduler.single) {
+      // Not one byte more than the whole file has to come through again
+      first->end = res - 1;
+      stats_add(first->index, 0, res, 0);
+      scheduler.next_unit = scheduler.unit_count;
+    } else if (sized && scheduler.unit_count > 0 &&
+               scheduler.units[0].start == 0) {
+      first->end = scheduler.units[0].end;
+      stats_add(first->index, 0, first->end + 1, 0);
+      scheduler.next_unit = 1;
+    } else {
+      first->abandoned = true;
+    }
+    pthread_mutex_unlock(&first->lock);
+  }
+  __atomic_store_n(&scheduler.sizing, SIZE_READY, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&scheduler.cond);
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+/* ===============================================================
+                      PROGRESS and POST-DOWNLOAD
+=============================================================== */
+// Print bytes downloaded/total bytes and progress
+void printProgress(curl_off_t downloaded, curl_off_t total) {
+  // Threads waiting for the connection limit have nothing yet
+  double percent = total > 0 ? (double)downloaded / total * 100 : 0;
+
+  // Find suitable unit for downloaded and total
+  if (total > 1000000000)
+    printf("%.2f / %.2f GB (%.2f%%)\n", (double)downloaded / 1000000000,
+           (double)total / 1000000000, percent);
+  else if (total > 1000000)
+    printf("%.2f / %.2f MB (%.2f%%)\n", (double)downloaded / 1000000,
+           (double)total / 1000000, percent);
+  else if (total > 1000)
+    printf("%.2f / %.2f KB (%.2f%%)\n", (double)downloaded / 1000,
+           (double)total / 1000, percent);
+  else
+    printf("%ld / %ld B (%.2f%%)\n", downloaded, total, percent);
+}
+
+// Print speed and ETA
+void printSpeed(curl_off_t downloaded, curl_off_t total, time_t start_time,
+                time_t elapsed_time) {
+  // Calculate speed and eta
+  double speed = (double)downloaded / (time(NULL) - start_time);
+  double eta = (double)(total - downloaded) / speed;
+
+  // Find suitable unit for speed
+  if (speed > 1000000000)
+    printf("%.2f GB/s", speed / 1000000000);
+  else if (speed > 1000000)
+    printf("%.2f MB/s", speed / 1000000);
+  else if (speed > 1000)
+    printf("%.2f KB/s", speed / 1000);
+  else
+    printf("%.2f B/s", speed);
+
+  // Find suitable unit for ETA
+  if (eta > 3600)
+    printf(" (%.2f hours remaining)\n", eta / 3600);
+  else if (eta > 60)
+    printf(" (%.2f minutes remaining)\n", eta / 60);
+  else
+    printf(" (%.2f seconds remaining)\n", eta);
+}
+
+// Pause handler, each transfer picks up the change from the thread that drives
+// it in sync_pause
+void pause_handler() {
+  if (paused) {
+    // Resume all threads
+    paused = false;
+
+    // Print to log
+    char log[256];
+    snprintf(log, sizeof(log), GREEN " INFO | Download resumed.\n" RESET);
+    add_log(log);
+  } else {
+    // Pause all threads
+    paused = true;
+    // Print to log
+    char log[256];
+    snprintf(log, sizeof(log), YELLOW " INFO | Download paused.\n" RESET);
+    add_log(log);
+  }
+}
+
+// Raise or lower the speed limits by THROTTLE_STEP, lowering without a limit
+// starts from the current speed. Threads pick up the new limits on their next
+// write
+void rate_handler(bool raise) {
+  unsigned long long rate = settings.rate_limit;
+  unsigned long long conn_rate = settings.conn_rate;
+  if (rate == 0 && conn_rate == 0) {
+    if (raise || controller.rate <= 0) return;
+    rate = controller.rate;
+  }
+
+  double factor = raise ? THROTTLE_STEP : 1 / THROTTLE_STEP;
+  set_rate_limits(rate * factor, conn_rate * factor);
+
+  // Print to log
+  char rate_str[32], conn_str[32];
+  format_rate(rate_str, sizeof(rate_str), settings.rate_limit);
+  format_rate(conn_str, sizeof(conn_str), settings.conn_rate);
+  char log[256];
+  if (settings.rate_limit && settings.conn_rate)
+    snprintf(log, sizeof(log),
+             YELLOW " INFO | Speed limited to %s, %s per connection.\n" RESET,
+             rate_str, conn_str);
+  else if (settings.rate_limit)
+    snprintf(log, sizeof(log), YELLOW " INFO | Speed limited to %s.\n" RESET,
+             rate_str);
+  else
+    snprintf(log, sizeof(log),
+             YELLOW " INFO | Speed limited to %s per connection.\n" RESET,
+             conn_str);
+  add_log(log);
+}
+
+// Lift all speed limits
+void unlimit_handler() {
+  if (settings.rate_limit == 0 && settings.conn_rate == 0) return;
+  set_rate_limits(0, 0);
+
+  // Print to log
+  char log[256];
+  snprintf(log, sizeof(log), GREEN " INFO | Speed limits lifted.\n" RESET);
+  add_log(log);
+}
+
+// SIGUSR1 lowers and SIGUSR2 raises the speed limits, the change is made by
+// the main thread since logging is not safe in a signal handler
+void rate_signal_handler(int sig) {
+  __atomic_add_fetch(&rate_signal, sig == SIGUSR2 ? 1 : -1, __ATOMIC_RELAXED);
+}
+
+// Apply limit changes asked for by signals since the last call
+void apply_rate_signals() {
+  int signalled = __atomic_exchange_n(&rate_signal, 0, __ATOMIC_RELAXED);
+  for (; signalled > 0; signalled--) rate_handler(true);
+  for (; signalled < 0; signalled++) rate_handler(false);
+}
+
+// Quit handler
+void quit_handler() {
+  cancelled = true;
+
+  // Print to log
+  char log[256];
+  snprintf(log, sizeof(log),
+           RED "ERROR | Download cancelled by user, exiting...\n" RESET);
+  add_log(log);
+}
+
+// Tell the threads or loops to give up their ranges and exit. Each one aborts
+// its transfers, from progress_callback or loop_sweep, and cleans up its own
+// curl handles
+void stop_workers() {
+  pthread_mutex_lock(&scheduler.mutex);
+  __atomic_store_n(&scheduler.stopping, true, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&scheduler.cond);
+  pthread_mutex_unlock(&scheduler.mutex);
+}
+
+// Decide how many connections may take work, AIMD style: one more while the
+// total rate keeps rising, half as many when the server pushes back. Threads
+// over the limit finish their range and then wait
+void control_connections() {
+  double now = get_time();
+  if (controller.checked == 0) controller.checked = now;
+  if (now - controller.checked < CONTROL_INTERVAL) return;
+
+  // Each thread's rate too, for the progress screen
+  curl_off_t downloaded = 0;
+  for (int i = 0; i < settings.max_threads; i++) {
+    DLStats *stats = &progress.threads[i];
+    curl_off_t bytes = stats_read(i).downloaded_bytes;
+    stats->rate = bytes > stats->measured ? (bytes - stats->measured) /
+                                                (now - controller.checked)
+                                          : 0;
+    stats->measured = bytes;
+    downloaded += bytes;
+  }
+  double rate = (downloaded - controller.bytes) / (now - controller.checked);
+  controller.rate = rate;
+  control_mirrors(now - controller.checked);
+  controller.checked = now;
+  controller.bytes = downloaded;
+
+  int throttled = __atomic_exchange_n(&scheduler.throttled, 0, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&scheduler.mutex);
+  int limit = scheduler.conn_limit;
+  char log[256] = "";
+
+  // Without Range there is only ever the one connection
+  if (scheduler.single) {
+    pthread_mutex_unlock(&scheduler.mutex);
+    return;
+  }
+
+  // Remember the best rate for the host profile
+  if (rate > controller.peak_rate) {
+    controller.peak_rate = rate;
+    controller.peak_conns = limit;
+  }
+
+  if (throttled > 0) {
+    // Back off and stay there for a while
+    if (limit > 1) {
+      limit /= 2;
+      snprintf(log, sizeof(log),
+               YELLOW " INFO | Server pushed back, using %d connections.\n"
+                      RESET,
+               limit);
+    }
+    controller.best_rate = rate;
+    controller.settled = true;
+    controller.settled_at = now;
+  } else if (rate == 0) {
+    // Nothing to judge by, paused or between ranges
+  } else if (controller.settled) {
+    // Try one more connection every so often, things may have changed
+    if (now - controller.settled_at >= CONTROL_PROBE &&
+        limit < settings.max_threads) {
+      controller.settled = false;
+      controller.best_rate = rate;
+      limit++;
+    }
+  } else if (rate > controller.best_rate * (1 + CONTROL_GAIN)) {
+    // The last connection helped, add another
+    controller.best_rate = rate;
+    if (limit < settings.max_threads) limit++;
+  } else {
+    // It did not, take it back and stay here for a while
+    if (limit > 1) limit--;
+    controller.settled = true;
+    controller.settled_at = now;
+  }
+
+  if (limit != scheduler.conn_limit) {
+    if (*log == '\0')
+      snprintf(log, sizeof(log),
+               GREY " INFO | Using %d connections.\n" RESET, limit);
+    scheduler.conn_limit = limit;
+    pthread_cond_broadcast(&scheduler.cond);
+  }
+  pthread_mutex_unlock(&scheduler.mutex);
+
+  if (*log) add_log(log);
+}
+
+// Wait for all threads to complete, print status and progress bar, returns
+// false if the download was stopped
+bool wait_for_threads() {
+  bool stopped = false;
+  while (completed_counter < settings.max_threads) {
+    // ncurses used here for non blocking read, allowing pause and quit at
+    // anytime
+    initscr();
+    // Get new window size in case of resize
+    getmaxyx(stdscr, window_height, window_width);
+    timeout(500);
+    noecho();
+    cbreak();
+    char c = getch();
+    if (c == 'p' || c == 'P') {
+      pause_handler();
+    }
+    if (c == 'q' || c == 'Q') {
+      quit_handler();
+    }
+    if (c == '+' || c == '=') {
+      rate_handler(true);
+    }
+    if (c == '-' || c == '_') {
+      rate_handler(false);
+    }
+    if (c == 'u' || c == 'U') {
+      unlimit_handler();
+    }
+    endwin();
+    apply_rate_signals();
+
+    // Start printing progress
+    clear_screen();
+    print_header();
+    print_download_info();
+
+    // Progress Bar and Status
+    double thread_bar_length = window_width - 57;
+    curl_off_t total_downloaded =
+        __atomic_load_n(&journal.resumed_bytes, __ATOMIC_RELAXED);
+    curl_off_t total_bytes = content_length;
+
+    printf(BOLD);
+    print_center("[ Progress | Press P to pause, Q to quit, +/- to limit speed ]");
+    printf("\n\n" RESET);
+
+    for (int i = 0; i < settings.max_threads; i++) {
+      // One snapshot per thread, so its bar, rate and numbers agree
+      DLStats stats = stats_read(i);
+      double done = stats.total_bytes > 0
+                        ? (double)stats.downloaded_bytes / stats.total_bytes
+                        : 0;
+      total_downloaded += stats.downloaded_bytes;
+
+      // Past MAX_THREADS connections the bars would not fit on the screen
+      if (i >= MAX_THREADS) continue;
+
+      printf(" Thread %d: " WHITE, i);
+
+      for (double j = 0; j < done * thread_bar_length + 1.0; j++) {
+        printf("█");
+      }
+
+      printf(GREY);
+
+      for (double j = done * thread_bar_length; j < thread_bar_length; j++) {
+        printf("█");
+      }
+
+      char rate[32];
+      format_rate(rate, sizeof(rate), stats.rate);
+      printf(" " RESET "%11s ", rate);
+      if (stats.retries > 0)
+        printf("%lld %s ", (long long)stats.retries,
+               stats.retries == 1 ? "retry" : "retries");
+      printProgress(stats.downloaded_bytes, stats.total_bytes);
+    }
+    if (settings.max_threads > MAX_THREADS)
+      printf(" and %d more connections\n", settings.max_threads - MAX_THREADS);
+
+    // Update speed and progress
+    time_t current_time = time(NULL);
+    double elapsed_time = difftime(current_time, start_time);
+    double speed = total_downloaded / elapsed_time;
+
+    // Print progress
+    printf("\n");
+    for (int i = 0; i < (window_width - 24) / 2; i++) printf(" ");
+    printProgress(total_downloaded, total_bytes);
+
+    // Print speed and ETA
+    for (int i = 0; i < (window_width - 37) / 2; i++) printf(" ");
+    printSpeed(total_downloaded, total_bytes, start_time, elapsed_time);
+
+    // Check for logs
+    printf("\n" BOLD);
+    print_center("[ Logs ]");
+    printf("\n" RESET);
+    printf("%s", log_buffer);
+
+    // Save how far the download got every so often
+    journal_checkpoint(false);
+
+    // Use as many connections as keep helping
+    control_connections();
+
+    // Stop if "exiting..." is found in logs, a batch goes on with the next
+    // file once the threads are gone
+    if (strstr(log_buffer, "exiting...") != NULL) {
+      stop_workers();
+      stopped = true;
+      break;
+    }
+  }
+
+  // Join all threads after download is complete
+  if (settings.loops > 0) {
+    for (int i = 0; i < settings.loops; i++) pthread_join(loops[i].thread, NULL);
+    return !stopped;
+  }
+  for (int i = 0; i < settings.max_threads; i++) {
+    pthread_join(thread_infos[i]->thread, NULL);
+  }
+  return !stopped;
+}
+
+// Free everything if exist
+void free_all() {
+  // Free thread info
+  for (int i = 0; thread_infos && i < settings.max_threads; i++) {
+    if (thread_infos[i] && thread_infos[i]->args) free(thread_infos[i]->args);
+    if (thread_infos[i]) ring_destroy(thread_infos[i]->ring);
+    if (thread_infos[i]) free(thread_infos[i]);
+  }
+  if (thread_infos) free(thread_infos);
+
+  // Free progress
+  if (progress.threads) free(progress.threads);
+
+  // Free work units
+  if (scheduler.units) free(scheduler.units);
+  if (scheduler.returned) free(scheduler.returned);
+
+  // Free event loops
+  if (loops) free(loops);
+
+  // Free mirrors
+  if (mirrors) free(mirrors);
+
+  // Free journal
+  if (journal.path) free(journal.path);
+  if (journal.validator) free(journal.validator);
+  if (journal.bitmap) free(journal.bitmap);
+  if (journal.done) free(journal.done);
+}
+
+// Clear what a download leaves behind in the globals, so a batch can run the
+// next file from a clean slate
+void reset_download() {
+  thread_infos = NULL;
+  loops = NULL;
+  mirrors = NULL;
+  mirror_count = 0;
+  output_fd = -1;
+  output_map = NULL;
+  direct_fd = -1;
+  content_length = 0;
+  remote_validator[0] = '\0';
+  completed_counter = 0;
+  memset(&progress, 0, sizeof(progress));
+  memset(&scheduler, 0, sizeof(scheduler));
+  memset(&journal, 0, sizeof(journal));
+  memset(&controller, 0, sizeof(controller));
+  memset(&profile, 0, sizeof(profile));
+  memset(&direct_pool, 0, sizeof(direct_pool));
+
+  // Logs of the last file would stop the next one if it said "exiting..."
+  pthread_mutex_lock(&log_mutex);
+  log_buffer[0] = '\0';
+  pthread_mutex_unlock(&log_mutex);
+}
+
+// Download settings.url to settings.filename over as many connections as keep
+// helping, returns true once the whole file is in place
+bool download_file() {
+  reset_download();
+
+  // Look up what earlier runs learned about the host
+  profile_load();
+
+  // Start with a few connections, the controller adds more while they help
+  clear_screen();
+  print_header();
+  printf(BOLD "Starting download with up to %d connections...\n" RESET,
+         settings.max_threads);
+
+  // Setup download
+  setup_download();
+
+  // Start timer
+  start_time = time(NULL);
+
+  // Wait for all threads to complete
+  bool finished = wait_for_threads();
+
+  // Remember what this run learned about the host for the next one
+  profile_save();
+
+  bool complete = finished && journal_complete();
+
+  // A stream is only complete once the flusher got all of it out. It can
+  // still fail after the progress screen is gone, the logs tell why
+  if (settings.io_mode == IO_STREAM) {
+    complete = stream_finish(complete);
+    if (finished && !complete) printf("\n%s", log_buffer);
+  }
+
+  if (complete) {
+    // Print finish
+    printf("\n\n" GREEN BOLD);
+    print_center("Download Complete ");
+    printf(CHECKMARK "\n" RESET);
+
+    // The hasher reads the last bytes back before the file is closed
+    digest_finish(true);
+
+    // Close output file, the journal is not needed anymore
+    close_output();
+    journal_remove();
+  } else {
+    // Save what made it to the file so the next run can pick up from there
+    digest_finish(false);
+    journal_checkpoint(true);
+    close_output();
+
+    printf("\n\n" YELLOW BOLD);
+    print_center(settings.io_mode == IO_STREAM
+                     ? "Download Stopped, the output is incomplete"
+                     : "Download Stopped, run again to resume");
+    printf("\n" RESET);
+  }
+
+  // Free everything
+  free_all();
+  return complete;
+}
+
+/* ===============================================================
+                      SMALL FILES and BATCH MODE
+=============================================================== */
+// Index of the URL's host in the batch, added if it is new
+int batch_host(char *url) {
+  char name[256] = "";
+  url_host(url, name, sizeof(name));
+  for (int i = 0; i < batch.host_count; i++)
+    if (strcmp(batch.hosts[i].name, name) == 0) return i;
+
+  batch.hosts =
+      realloc(batch.hosts, (batch.host_count + 1) * sizeof(DLBatchHost));
+
+  // Check error
+  if (batch.hosts == NULL) {
+    printf("ERROR | Could not allocate batch hosts\n");
+    exit(EXIT_FAILURE);
+  }
+
+  DLBatchHost *host = &batch.hosts[batch.host_count];
+  memset(host, 0, sizeof(DLBatchHost));
+  snprintf(host->name, sizeof(host->name), "%s", name);
+  return batch.host_count++;
+}
+
+// Path a file of the batch is saved to, the name given in the list or else the
+// last part of the URL's path
+char *batch_filename(char *address, char *name, char *dir) {
+  CURLU *url = curl_url();
+  char *path = NULL;
+  if (name == NULL &&
+      curl_url_set(url, CURLUPART_URL, address, 0) == CURLUE_OK &&
+      curl_url_get(url, CURLUPART_PATH, &path, CURLU_URLDECODE) == CURLUE_OK)
+    name = strrchr(path, '/') != NULL ? strrchr(path, '/') + 1 : path;
+  if (name == NULL || *name == '\0' || strcmp(name, ".") == 0 ||
+      strcmp(name, "..") == 0)
+    name = "index.html";
+
+  char *filename = malloc(strlen(dir) + strlen(name) + 2);
+  if (filename != NULL) sprintf(filename, "%s/%s", dir, name);
+  curl_free(path);
+  curl_url_cleanup(url);
+  return filename;
+}
+
+// Read the URL list, one "<url> [<filename>]" per line, blank lines and lines
+// starting with # are skipped
+void batch_load(char *dir) {
+  FILE *input = strcmp(settings.input, "-") == 0 ? stdin
+                                                 : fopen(settings.input, "r");
+
+  // Check error
+  if (input == NULL) {
+    printf("ERROR | Could not open URL list %s\n", settings.input);
+    exit(EXIT_FAILURE);
+  }
+
+  char *line = NULL;
+  size_t size = 0;
+  int capacity = 0;
+  while (getline(&line, &size, input) != -1) {
+    char *url = strtok(line, " \t\r\n");
+    if (url == NULL || *url == '#') continue;
+    char *name = strtok(NULL, " \t\r\n");
+
+    if (batch.count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      batch.files = realloc(batch.files, capacity * sizeof(DLBatchFile));
+    }
+    DLBatchFile *file = batch.files ? &batch.files[batch.count] : NULL;
+    if (file != NULL) {
+      file->url = strdup(url);
+      file->filename = batch_filename(url, name, dir);
+      file->host = batch_host(url);
+      file->state = FILE_PENDING;
+    }
+
+    // Check error
+    if (file == NULL || file->url == NULL || file->filename == NULL) {
+      printf("ERROR | Could not allocate batch file %d\n", batch.count);
+      exit(EXIT_FAILURE);
+    }
+
+    // Queue it with its host
+    DLBatchHost *host = &batch.hosts[file->host];
+    host->files = realloc(host->files, (host->file_count + 1) * sizeof(int));
+    if (host->files == NULL) {
+      printf("ERROR | Could not allocate batch file %d\n", batch.count);
+      exit(EXIT_FAILURE);
+    }
+    host->files[host->file_count++] = batch.count++;
+  }
+
+  free(line);
+  if (input != stdin) fclose(input);
+}
+
+// Hand a batch worker the earliest pending file of a host that has a
+// connection to spare, waits while every host with files left is busy and
+// returns NULL once nothing is pending
+DLBatchFile *batch_take() {
+  int host_conns = settings.host_conns ? settings.host_conns
+                                       : settings.max_threads;
+
+  pthread_mutex_lock(&batch.mutex);
+  while (!cancelled) {
+    DLBatchHost *best = NULL;
+    bool pending = false;
+    for (int i = 0; i < batch.host_count; i++) {
+      DLBatchHost *host = &batch.hosts[i];
+      if (host->next == host->file_count) continue;
+      pending = true;
+      if (host->active < host_conns &&
+          (best == NULL || host->files[host->next] < best->files[best->next]))
+        best = host;
+    }
+    if (!pending) break;
+
+    if (best != NULL) {
+      DLBatchFile *file = &batch.files[best->files[best->next++]];
+      file->state = FILE_ACTIVE;
+      best->active++;
+      pthread_mutex_unlock(&batch.mutex);
+      return file;
+    }
+    pthread_cond_wait(&batch.cond, &batch.mutex);
+  }
+  pthread_mutex_unlock(&batch.mutex);
+  return NULL;
+}
+
+// Header callback of batch transfers, learns the length of the whole file once
+// the headers are complete
+size_t batch_header_callback(char *buffer, size_t size, size_t nitems,
+                             void *userdata) {
+  DLBatchWorker *worker = (DLBatchWorker *)userdata;
+  size_t len = size * nitems;
+  if (!(len == 2 && buffer[0] == '\r') && !(len == 1 && buffer[0] == '\n'))
+    return len;
+
+  long code = 0;
+  long long from = -1, to = -1, total = -1;
+  struct curl_header *header;
+  curl_easy_getinfo(worker->curl, CURLINFO_RESPONSE_CODE, &code);
+  if (code == 206 &&
+      curl_easy_header(worker->curl, "Content-Range", 0, CURLH_HEADER, -1,
+                       &header) == CURLHE_OK) {
+    // Only the start of the file can be written from byte 0
+    int fields =
+        sscanf(header->value, "bytes %lld-%lld/%lld", &from, &to, &total);
+    if (from != 0 || fields < 2) return 0;
+
+    // Without a total, fewer bytes than asked for means the file ends there,
+    // a full range may have more behind it and goes to the split download
+    if (fields == 2 && (unsigned long long)to + 1 < settings.small_size)
+      total = to + 1;
+    else if (fields == 2)
+      worker->large = true;
+  } else if (code == 200)
+    curl_easy_getinfo(worker->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                      &total);
+  worker->length = total;
+
+  return len;
+}
+
+// Write callback of batch transfers, small files are written in order as they
+// come in
+size_t batch_write_callback(char *ptr, size_t size, size_t nmemb,
+                            void *userdata) {
+  DLBatchWorker *worker = (DLBatchWorker *)userdata;
+  size_t realsize = size * nmemb;
+
+  // A large file is left for the split download, stop the transfer before
+  // anything is written. A 200 without a length streams the whole file, so
+  // it is written here whatever its size
+  if (worker->large ||
+      (worker->length >= 0 &&
+       (unsigned long long)worker->length > settings.small_size)) {
+    worker->large = true;
+    return 0;
+  }
+
+  if (worker->fd < 0) {
+    worker->fd =
+        open(worker->file->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (worker->fd < 0) return 0;
+  }
+
+  for (size_t written = 0; written < realsize;) {
+    ssize_t n = write(worker->fd, ptr + written, realsize - written);
+    if (n < 0 && errno == EINTR) continue;
+    if (n < 0) return 0;
+    written += n;
+  }
+  __atomic_add_fetch(&batch.bytes, realsize, __ATOMIC_RELAXED);
+
+  // Small files count against the download's speed limit too
+  double wait = bucket_take(&bandwidth, realsize);
+  if (wait > 0) usleep(wait * 1e6);
+
+  return realsize;
+}
+
+// Download a small file over the worker's connection, the range asked for
+// covers the whole file unless it is large. Makes up to tries attempts with
+// backoff like the split download does
+DLFileState batch_fetch(DLBatchWorker *worker, DLBatchFile *file, int tries) {
+  char range[64];
+  snprintf(range, sizeof(range), "0-%llu", settings.small_size - 1);
+  curl_easy_setopt(worker->curl, CURLOPT_URL, file->url);
+  curl_easy_setopt(worker->curl, CURLOPT_RANGE, range);
+  worker->file = file;
+
+  for (int attempt = 1;; attempt++) {
+    worker->fd = -1;
+    worker->length = -1;
+    worker->large = false;
+    CURLcode res = curl_easy_perform(worker->curl);
+    if (worker->large) return FILE_LARGE;
+
+    // An empty file cannot be asked for by range and never calls
+    // write_callback, create it here
+    long code = 0;
+    curl_easy_getinfo(worker->curl, CURLINFO_RESPONSE_CODE, &code);
+    bool empty = res == CURLE_HTTP_RETURNED_ERROR && code == 416;
+    if ((res == CURLE_OK || empty) && worker->fd < 0)
+      worker->fd = open(file->filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+    bool closed = worker->fd >= 0 && close(worker->fd) == 0;
+    if ((res == CURLE_OK || empty) && closed) return FILE_DONE;
+
+    if (attempt == tries) {
+      char log[512];
+      snprintf(log, sizeof(log), RED "ERROR | %s: %s\n" RESET, file->url,
+               *worker->errbuf ? worker->errbuf : curl_easy_strerror(res));
+      add_log(log);
+      return FILE_FAILED;
+    }
+
+    long delay = (long)RETRY_BASE_MS << (attempt - 1);
+    usleep((delay < RETRY_MAX_MS ? delay : RETRY_MAX_MS) * 1000);
+  }
+}
+
+// Set up the curl handle of a small file worker
+void batch_handle(DLBatchWorker *worker) {
+  CURL *curl = curl_easy_init();
+  worker->curl = curl;
+  curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, batch_write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, worker);
+  curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, batch_header_callback);
+  curl_easy_setopt(curl, CURLOPT_HEADERDATA, worker);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, worker->errbuf);
+}
+
+// Fetch a small file with a single request on the main thread, without the
+// worker threads, file preallocation or progress screen a split download sets
+// up. Returns false when the file turned out large or the request failed, and
+// download_file has to take over
+bool fetch_small() {
+  // Pieces are checked by the split download, which can fetch a bad one again
+  if (settings.manifest != NULL || settings.manifest_out != NULL ||
+      metalink.piece_md != NULL)
+    return false;
+
+  // A Metalink already says the file is too large for one request
+  if (metalink.size > (curl_off_t)settings.small_size) return false;
+
+  // A download that was stopped before is resumed instead
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s" JOURNAL_SUFFIX, settings.filename);
+  if (access(path, F_OK) == 0) return false;
+
+  // Check if file exists, asks user if they want to overwrite
+  if (access(settings.filename, F_OK) == 0) {
+    printf(RED BOLD "File %s already exists, overwrite? (y/n) " RESET,
+           settings.filename);
+    char c;
+    scanf("%c", &c);
+    if (c == 'n') exit(EXIT_SUCCESS);
+  }
+  overwrite_ok = true;
+
+  DLBatchWorker worker = {0};
+  DLBatchFile file = {settings.url, settings.filename, 0, FILE_ACTIVE};
+  batch_handle(&worker);
+  DLFileState state = batch_fetch(&worker, &file, 1);
+  curl_easy_cleanup(worker.curl);
+  if (state != FILE_DONE) return false;
+
+  // Print finish
+  printf(GREEN BOLD);
+  print_center("Download Complete ");
+  printf(CHECKMARK "\n" RESET);
+
+  // A single request has nothing to overlap the hash with, the file is small
+  // enough to read back at once
+  if (digest_init()) {
+    int fd = open(settings.filename, O_RDONLY);
+    struct stat st;
+    digest.failed =
+        fd < 0 || fstat(fd, &st) != 0 || !digest_read(fd, st.st_size);
+    if (fd >= 0) close(fd);
+    digest_finish(true);
+  }
+  return true;
+}
+
+// Batch worker, downloads small files one after the other over one reused
+// connection until none are pending
+void *batch_worker(void *arg) {
+  DLBatchWorker *worker = (DLBatchWorker *)arg;
+  DLBatchFile *file;
+
+  while ((file = batch_take()) != NULL) {
+    DLFileState state = batch_fetch(worker, file, RETRY_TRIES);
+
+    pthread_mutex_lock(&batch.mutex);
+    file->state = state;
+    batch.hosts[file->host].active--;
+    batch.finished++;
+    pthread_cond_broadcast(&batch.cond);
+    pthread_mutex_unlock(&batch.mutex);
+  }
+
+  return NULL;
+}
+
+// Show how the small files are going until every one has been looked at, Q
+// stops handing out new ones
+void wait_for_batch() {
+  double started = get_time();
+
+  while (!cancelled) {
+    // ncurses used here for non blocking read, allowing quit at anytime
+    initscr();
+    getmaxyx(stdscr, window_height, window_width);
+    timeout(500);
+    noecho();
+    cbreak();
+    char c = getch();
+    if (c == 'q' || c == 'Q') {
+      quit_handler();
+    }
+    endwin();
+    apply_rate_signals();
+
+    // Count files by state
+    int counts[FILE_FAILED + 1] = {0};
+    pthread_mutex_lock(&batch.mutex);
+    for (int i = 0; i < batch.count; i++) counts[batch.files[i].state]++;
+    int finished = batch.finished;
+    pthread_mutex_unlock(&batch.mutex);
+
+    clear_screen();
+    print_header();
+    printf(BOLD);
+    print_center("[ Batch | Press Q to quit ]");
+    printf("\n\n" RESET);
+
+    char line[256];
+    snprintf(line, sizeof(line),
+             "%d / %d files done, %d failed, %d large files to split",
+             counts[FILE_DONE], batch.count, counts[FILE_FAILED],
+             counts[FILE_LARGE]);
+    print_center(line);
+    printf("\n");
+
+    curl_off_t bytes = __atomic_load_n(&batch.bytes, __ATOMIC_RELAXED);
+    char rate[32];
+    format_rate(rate, sizeof(rate), bytes / (get_time() - started));
+    snprintf(line, sizeof(line), "%.2f MB at %s", (double)bytes / 1000000,
+             rate);
+    print_center(line);
+    printf("\n");
+
+    // Check for logs
+    printf("\n" BOLD);
+    print_center("[ Logs ]");
+    printf("\n" RESET);
+    printf("%s", log_buffer);
+
+    if (finished == batch.count) break;
+  }
+
+  // Let waiting workers see the quit
+  pthread_mutex_lock(&batch.mutex);
+  pthread_cond_broadcast(&batch.cond);
+  pthread_mutex_unlock(&batch.mutex);
+}
+
+// Download every file of the URL list in one process. Small files are fetched
+// whole by a pool of reused connections, large ones are split afterwards one
+// after the other, so at most max_threads connections are open at any time.
+// Returns true if every file was downloaded
+bool run_batch() {
+  // A batch is meant to run unattended
+  overwrite_ok = true;
+
+  char *dir = settings.filename ? settings.filename : ".";
+  mkdir(dir, 0755);
+  pthread_mutex_init(&batch.mutex, NULL);
+  pthread_cond_init(&batch.cond, NULL);
+  batch_load(dir);
+
+  // Small files first, over up to max_threads connections. Each of them is a
+  // thread of its own, even with --loops
+  int count = settings.max_threads < MAX_THREADS ? settings.max_threads
+                                                 : MAX_THREADS;
+  if (count > batch.count) count = batch.count;
+  DLBatchWorker *workers = calloc(count, sizeof(DLBatchWorker));
+
+  // Check error
+  if (count > 0 && workers == NULL) {
+    printf("ERROR | Could not allocate batch workers\n");
+    exit(EXIT_FAILURE);
+  }
+
+  for (int i = 0; i < count; i++) {
+    batch_handle(&workers[i]);
+    pthread_create(&workers[i].thread, NULL, batch_worker, &workers[i]);
+  }
+
+  wait_for_batch();
+
+  for (int i = 0; i < count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    curl_easy_cleanup(workers[i].curl);
+  }
+  free(workers);
+
+  // Then the large files, each with every connection the host may take. The
+  // connection limit and the controller never go past max_threads, which is
+  // the user's again once they are done
+  int max_threads = settings.max_threads;
+  int loop_count = settings.loops;
+  for (int i = 0; i < batch.count && !cancelled; i++) {
+    DLBatchFile *file = &batch.files[i];
+    if (file->state != FILE_LARGE) continue;
+    settings.url = file->url;
+    settings.filename = file->filename;
+    settings.max_threads = max_threads;
+    settings.loops = loop_count;
+    if (settings.host_conns > 0 && settings.host_conns < max_threads)
+      settings.max_threads = settings.host_conns;
+    file->state = download_file() ? FILE_DONE : FILE_FAILED;
+  }
+  settings.max_threads = max_threads;
+  settings.loops = loop_count;
+
+  // Print finish
+  int done = 0;
+  for (int i = 0; i < batch.count; i++)
+    if (batch.files[i].state == FILE_DONE) done++;
+  char line[256];
+  snprintf(line, sizeof(line), "Batch %s, %d of %d files downloaded ",
+           done == batch.count ? "Complete"
+           : cancelled         ? "Stopped"
+                               : "Finished",
+           done, batch.count);
+  printf("\n\n%s" BOLD, done == batch.count ? GREEN : YELLOW);
+  print_center(line);
+  printf("%s\n" RESET, done == batch.count ? CHECKMARK : "");
+
+  // Free the list
+  for (int i = 0; i < batch.count; i++) {
+    free(batch.files[i].url);
+    free(batch.files[i].filename);
+  }
+  for (int i = 0; i < batch.host_count; i++) free(batch.hosts[i].files);
+  free(batch.files);
+  free(batch.hosts);
+  pthread_mutex_destroy(&batch.mutex);
+  pthread_cond_destroy(&batch.cond);
+  return done == batch.count;
+}
+
+/* ===============================================================
+                              MAIN
+=============================================================== */
+int main(int argc, char *argv[]) {
+  // Parse command line arguments
+  parse_args(argc, argv);
+
+  // With -o - the file takes stdout over, everything printed goes to stderr,
+  // and a reader that goes away shows up as a failed write
+  if (settings.io_mode == IO_STREAM) {
+    stream.fd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  // Get window width and height
+  struct winsize w;
+  ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
+  window_width = w.ws_col;
+  window_height = w.ws_row;
+
+  // Initialize curl
+  curl_global_init(CURL_GLOBAL_ALL);
+  setup_share();
+
+  // Speed limits can be changed from outside while downloading
+  signal(SIGUSR1, rate_signal_handler);
+  signal(SIGUSR2, rate_signal_handler);
+
+  // Init global mutex
+  pthread_mutex_init(&completed_mutex, NULL);
+
+  // Download every file of the list, or the file, small ones with a single
+  // request. A stream cannot take back what the small file request wrote
+  // before it failed, it always takes the split download. A download that
+  // stopped before the end is an error
+  int status = EXIT_SUCCESS;
+  if (settings.input != NULL)
+    status = run_batch() ? EXIT_SUCCESS : EXIT_FAILURE;
+  else if (settings.io_mode == IO_STREAM || !fetch_small())
+    status = download_file() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+  // A file that arrived but has the wrong checksum is an error too
+  if (digest.mismatch) status = EXIT_FAILURE;
+
+  // Destroy mutex
+  pthread_mutex_destroy(&completed_mutex);
+
+  // Cleanup curl
+  curl_share_cleanup(share);
+  curl_global_cleanup();
+
+  return status;
+}
@@ -0,0 +1,222 @@
+#!/usr/bin/env python3
+# Fault injection test for retries: serves a random file from a local server
+# that honors Range but cuts connections in the middle of a range, downloads
+# it with mtdown, then checks the output against the source and reports how
+# many bytes were sent twice because of the cuts. A retry that asks again
+# from the last byte in the file sends almost nothing twice, one that starts
+# its range over sends everything before the cut again.
+#
+# Usage: tests/fault_injection.py [--mtdown ./mtdown] [--size 50M]
+#                                 [--threads 4] [--cut 0.004] [--runs 3]
+#                                 [--max-resent 1.0]
+#
+# Needs python3 and script(1) from util-linux, mtdown draws its progress
+# screen with ncurses and wants a terminal.
+
+import argparse
+import hashlib
+import http.server
+import os
+import random
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+
+CHUNK = 64 * 1024
+
+
+class Server(http.server.ThreadingHTTPServer):
+    daemon_threads = True
+
+    def __init__(self, data, cut, seed):
+        super().__init__(("127.0.0.1", 0), Handler)
+        self.data = data
+        self.cut = cut
+        self.random = random.Random(seed)
+        self.lock = threading.Lock()
+        self.sent = 0     # body bytes written to sockets
+        self.cuts = []    # [start, cut] of bodies cut short, not retried yet
+        self.cut_count = 0
+        self.resent = 0   # bytes a retry asked for that were sent before
+
+    def handle_error(self, request, client_address):
+        # mtdown closes connections it has no more use for, that is expected
+        pass
+
+    def cut_at(self, length):
+        # Where to cut a chunk of this length, or -1 to send all of it
+        with self.lock:
+            if self.random.random() >= self.cut:
+                return -1
+            return self.random.randrange(length)
+
+    def request(self, start):
+        # A request starting inside a cut body is its retry, everything from
+        # there to the cut is sent again
+        with self.lock:
+            for span in self.cuts:
+                if span[0] <= start < span[1]:
+                    self.resent += span[1] - start
+                    self.cuts.remove(span)
+                    break
+
+    def count(self, start, sent, cut):
+        with self.lock:
+            self.sent += sent
+            if cut:
+                self.cuts.append([start, start + sent])
+                self.cut_count += 1
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def do_HEAD(self):
+        self.respond(False)
+
+    def do_GET(self):
+        self.respond(True)
+
+    def respond(self, body):
+        data = self.server.data
+        start, end, code = 0, len(data) - 1, 200
+        bounded = False
+        match = re.match(r"bytes=(\d*)-(\d*)$", self.headers.get("Range", ""))
+        if match and match.group(1):
+            start = int(match.group(1))
+            if match.group(2):
+                end = min(int(match.group(2)), len(data) - 1)
+                bounded = True
+            code = 206
+        if start > end:
+            self.send_response(416)
+            self.send_header("Content-Range", "bytes */%d" % len(data))
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+
+        self.send_response(code)
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("ETag", '"fault-injection"')
+        self.send_header("Content-Length", str(end - start + 1))
+        if code == 206:
+            self.send_header("Content-Range",
+                             "bytes %d-%d/%d" % (start, end, len(data)))
+        self.end_headers()
+        if not body:
+            return
+
+        self.server.request(start)
+        sent = 0
+        try:
+            for pos in range(start, end + 1, CHUNK):
+                chunk = data[pos:min(pos + CHUNK, end + 1)]
+
+                # The first GET asks for everything and is trimmed to its
+                # first unit later, mtdown stops reading it there while this
+                # end may still be sending. Only cut ranges it asked for
+                part = self.server.cut_at(len(chunk)) if bounded else -1
+                if part >= 0:
+                    # Send part of the chunk, then close the connection. A
+                    # reset would throw away what the client has not read
+                    # yet, and it could not resume from there
+                    self.wfile.write(chunk[:part])
+                    self.wfile.flush()
+                    sent += part
+                    self.connection.shutdown(socket.SHUT_RDWR)
+                    self.close_connection = True
+                    self.server.count(start, sent, True)
+                    return
+                self.wfile.write(chunk)
+                sent += len(chunk)
+        except (BrokenPipeError, ConnectionResetError):
+            pass
+        self.server.count(start, sent, False)
+
+
+def parse_size(text):
+    units = {"": 1, "K": 1 << 10, "M": 1 << 20, "G": 1 << 30}
+    match = re.match(r"(\d+)([KMG]?)$", text.upper())
+    if match is None:
+        raise argparse.ArgumentTypeError("bad size: " + text)
+    return int(match.group(1)) * units[match.group(2)]
+
+
+def run(args, data, workdir, seed):
+    server = Server(data, args.cut, seed)
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+
+    output = os.path.join(workdir, "out.bin")
+    for path in (output, output + ".mtdown"):
+        if os.path.exists(path):
+            os.remove(path)
+    # Hedges and the request for a small file would ask for bytes again
+    # without any cut, leave them out
+    command = "%s -u http://127.0.0.1:%d/file.bin -o %s -n %d " \
+              "--hedge-conns 0 --small-size 1" \
+        % (os.path.abspath(args.mtdown), server.server_address[1], output,
+           args.threads)
+
+    # Keep host profiles of earlier runs out of the way
+    env = dict(os.environ, XDG_CACHE_HOME=workdir)
+    with open(os.devnull, "wb") as devnull:
+        result = subprocess.run(["script", "-qec", command, "/dev/null"],
+                                stdin=subprocess.DEVNULL, stdout=devnull,
+                                stderr=devnull, env=env, cwd=workdir,
+                                timeout=600)
+    server.shutdown()
+    server.server_close()
+
+    same = False
+    if os.path.exists(output):
+        with open(output, "rb") as file:
+            same = hashlib.sha256(file.read()).digest() == \
+                hashlib.sha256(data).digest()
+    return result.returncode, same, server
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Check that mtdown retries a cut range from its last "
+                    "written byte")
+    parser.add_argument("--mtdown", default="./mtdown")
+    parser.add_argument("--size", type=parse_size, default=parse_size("50M"))
+    parser.add_argument("--threads", type=int, default=4)
+    parser.add_argument("--cut", type=float, default=0.004,
+                        help="chance of cutting the connection per 64K chunk")
+    parser.add_argument("--runs", type=int, default=3)
+    parser.add_argument("--max-resent", type=float, default=1.0,
+                        help="percent of the file sent twice before failing")
+    args = parser.parse_args()
+
+    if shutil.which("script") is None:
+        sys.exit("script(1) is needed to give mtdown a terminal")
+
+    data = random.Random(1).randbytes(args.size)
+    failed = False
+    with tempfile.TemporaryDirectory() as workdir:
+        for i in range(args.runs):
+            code, same, server = run(args, data, workdir, i)
+            resent = server.resent * 100.0 / len(data)
+            ok = code == 0 and same and resent <= args.max_resent
+            failed |= not ok
+            print("run %d: %s, exit %d, %d cuts, %.2f MB resent, %.2f MB "
+                  "sent for %.2f MB" % (i + 1, "ok" if ok else "FAILED", code,
+                                        server.cut_count, server.resent / 1e6,
+                                        server.sent / 1e6, len(data) / 1e6))
+            if not same:
+                print("run %d: output does not match the source" % (i + 1))
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()